@@ -0,0 +1,360 @@
+#include <simple_jpeg.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <string>
+
+/*
+ * simple_jpeg benchmark
+ * Measures encode throughput for every pixel format, for packed, strided,
+ * sliced, planar and tiled input layouts, RGB and grayscale output, and a range of image sizes.
+ *
+ * Conversion and compression times are taken from the encoder's EncodeStats.
+ *
+ * Usage: simple_jpeg_bench [--sizes thumb,1mp,24mp,100mp] [--formats u8,f32,...]
+ *                          [--min-time seconds] [--json]
+ * A human-readable table goes to stderr; with --json, results are written to
+ * stdout as JSON.
+ */
+
+using Clock = std::chrono::steady_clock;
+
+// IEEE-754 half-precision float to 32-bit float conversion
+// https://stackoverflow.com/a/60047308
+static uint32_t as_uint(const float x) { return *(uint32_t*) &x; }
+static uint16_t float_to_half(const float x) { // IEEE-754 16-bit floating-point format (without infinity): 1-5-10, exp-15, +-131008.0, +-6.1035156E-5, +-5.9604645E-8, 3.311 digits
+  const uint32_t b = as_uint(x) + 0x00001000; // round-to-nearest-even: add last bit after truncated mantissa
+  const uint32_t e = (b & 0x7F800000) >> 23; // exponent
+  const uint32_t m = b &
+                     0x007FFFFF; // mantissa; in line below: 0x007FF000 = 0x00800000-0x00001000 = decimal indicator flag - initial rounding
+  return (b & 0x80000000) >> 16 | (e > 112) * ((((e - 112) << 10) & 0x7C00) | m >> 13) |
+         ((e < 113) & (e > 101)) * ((((0x007FF000 + m) >> (125 - e)) + 1) >> 1) |
+         (e > 143) * 0x7FFF; // sign : normalized : denormalized : saturate
+}
+
+/*
+ * Discards output, counting the bytes written
+ */
+class NullWriter : public jpeg::Writer {
+public:
+  void write(const uint8_t*, size_t size) override { bytes += size; }
+
+  size_t bytes = 0;
+};
+
+struct Format {
+  const char* name;
+  jpeg::PixelFormat format;
+};
+
+static constexpr Format formats[] = {
+  {"u8", jpeg::PixelFormat::Uint8},
+  {"u16", jpeg::PixelFormat::Uint16},
+  {"f16", jpeg::PixelFormat::Float16},
+  {"u32", jpeg::PixelFormat::Uint32},
+  {"f32", jpeg::PixelFormat::Float32},
+  {"u64", jpeg::PixelFormat::Uint64},
+  {"f64", jpeg::PixelFormat::Float64},
+};
+
+struct Size {
+  const char* name;
+  uint32_t width;
+  uint32_t height;
+};
+
+static constexpr Size sizes[] = {
+  {"thumb", 256, 256},
+  {"1mp", 1280, 800},
+  {"24mp", 6000, 4000},
+  {"100mp", 12288, 8192},
+};
+
+enum class Layout {
+  // Pixels hold exactly the channels being written
+  Packed,
+  // RGBA pixels; grayscale reads a single channel out of each pixel
+  Strided,
+  // Packed pixels, reading a region out of a larger buffer
+  Sliced,
+  // One plane per component
+  Planar,
+  // Packed pixels in 64x64 tiles
+  Tiled,
+};
+
+static const char* layout_name(Layout layout) {
+  switch (layout) {
+    case Layout::Packed: return "packed";
+    case Layout::Strided: return "strided";
+    case Layout::Sliced: return "sliced";
+    case Layout::Planar: return "planar";
+    case Layout::Tiled: return "tiled";
+  }
+  return "";
+}
+
+/*
+ * Input image plus the params describing it
+ */
+struct Input {
+  std::vector<uint8_t> data;
+  jpeg::EncodeParams params;
+};
+
+/*
+ * Fills a buffer with a smooth gradient plus some noise, so compression does a
+ * realistic amount of work
+ */
+static void fill(std::vector<uint8_t>& data, jpeg::PixelFormat format, size_t width, size_t height, size_t channels) {
+  jpeg::EncodeParams formatParams{.pixelFormat = format};
+  const size_t sampleSize = formatParams.channelStride();
+  data.resize(width * height * channels * sampleSize);
+
+  uint32_t seed = 1;
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < width; x++) {
+      for (size_t c = 0; c < channels; c++) {
+        seed = seed * 1664525 + 1013904223;
+        float v = float(x + y * (c + 1)) / float(width + height * (c + 1)) + float(seed >> 24) / 2048.0f;
+        v = std::clamp(v, 0.0f, 0.999f);
+
+        uint8_t* ptr = data.data() + ((y * width + x) * channels + c) * sampleSize;
+        switch (format) {
+          case jpeg::PixelFormat::Uint8: *ptr = uint8_t(v * 256); break;
+          case jpeg::PixelFormat::Uint16: {
+            uint16_t i = uint16_t(v * 65536);
+            std::memcpy(ptr, &i, sizeof(i));
+            break;
+          }
+          case jpeg::PixelFormat::Float16: {
+            uint16_t h = float_to_half(v);
+            std::memcpy(ptr, &h, sizeof(h));
+            break;
+          }
+          case jpeg::PixelFormat::Uint32: {
+            uint32_t i = uint32_t(double(v) * 4294967296.0);
+            std::memcpy(ptr, &i, sizeof(i));
+            break;
+          }
+          case jpeg::PixelFormat::Float32: std::memcpy(ptr, &v, sizeof(v)); break;
+          case jpeg::PixelFormat::Uint64: {
+            uint64_t i = uint64_t(double(v) * 18446744073709551616.0);
+            std::memcpy(ptr, &i, sizeof(i));
+            break;
+          }
+          case jpeg::PixelFormat::Float64: {
+            double d = v;
+            std::memcpy(ptr, &d, sizeof(d));
+            break;
+          }
+        }
+      }
+    }
+  }
+}
+
+/*
+ * Rearranges packed pixels into row-major tiles, padding the grid to whole tiles
+ */
+static std::vector<uint8_t> to_tiles(const std::vector<uint8_t>& data, size_t width, size_t height, size_t pixelBytes, size_t tileSize) {
+  const size_t tilesAcross = (width + tileSize - 1) / tileSize;
+  const size_t tilesDown = (height + tileSize - 1) / tileSize;
+  const size_t tileBytes = tileSize * tileSize * pixelBytes;
+  std::vector<uint8_t> tiles(tilesAcross * tilesDown * tileBytes);
+
+  for (size_t y = 0; y < height; y++) {
+    for (size_t tx = 0; tx < tilesAcross; tx++) {
+      const size_t x = tx * tileSize;
+      uint8_t* dst = tiles.data() + ((y / tileSize) * tilesAcross + tx) * tileBytes + (y % tileSize) * tileSize * pixelBytes;
+      std::memcpy(dst, data.data() + (y * width + x) * pixelBytes, std::min(tileSize, width - x) * pixelBytes);
+    }
+  }
+  return tiles;
+}
+
+static Input make_input(jpeg::PixelFormat format, Layout layout, jpeg::ColorMode mode, const Size& size) {
+  const uint32_t components = mode == jpeg::ColorMode::RGB ? 3 : 1;
+
+  Input input;
+  input.params = {
+    .width = size.width,
+    .height = size.height,
+    .colorMode = mode,
+    .pixelFormat = format,
+  };
+
+  switch (layout) {
+    case Layout::Packed: {
+      fill(input.data, format, size.width, size.height, components);
+      break;
+    }
+    case Layout::Strided: {
+      fill(input.data, format, size.width, size.height, 4);
+      input.params.inChannels = 4;
+      input.params.inChannelOffset = mode == jpeg::ColorMode::RGB ? 0 : 1;
+      break;
+    }
+    case Layout::Sliced: {
+      // Encode the central region of a buffer with a quarter extra on each axis
+      const uint32_t fullWidth = size.width + size.width / 4;
+      const uint32_t fullHeight = size.height + size.height / 4;
+      fill(input.data, format, fullWidth, fullHeight, components);
+      input.params.inPixelOffset = size.width / 8;
+      input.params.inRowOffset = size.height / 8;
+      input.params.inRowStride = int32_t(fullWidth * components * input.params.channelStride());
+      break;
+    }
+    case Layout::Planar: {
+      // Filled as packed pixels, so each plane is a third of the buffer
+      fill(input.data, format, size.width, size.height, components);
+      const size_t planeBytes = input.data.size() / components;
+      for (uint32_t i = 0; i < components; i++) input.params.planes[i].data = input.data.data() + i * planeBytes;
+      break;
+    }
+    case Layout::Tiled: {
+      constexpr uint32_t tileSize = 64;
+      std::vector<uint8_t> packed;
+      fill(packed, format, size.width, size.height, components);
+      input.data = to_tiles(packed, size.width, size.height, components * input.params.channelStride(), tileSize);
+      input.params.tiling = {.width = tileSize, .height = tileSize};
+      break;
+    }
+  }
+
+  return input;
+}
+
+/*
+ * Median times of an encode, in seconds
+ */
+struct Timing {
+  double total;
+  double convert;
+  double compress;
+  size_t bytesOut;
+};
+
+static double seconds(std::chrono::nanoseconds duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+static double median(std::vector<double>& values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+/*
+ * Runs encodes until minTime has passed (at least three times)
+ */
+static Timing time_encode(jpeg::Encoder& enc, Input& input, double minTime) {
+  std::vector<double> totals, converts, compresses;
+  jpeg::EncodeStats stats;
+  input.params.stats = &stats;
+
+  const auto start = Clock::now();
+  while (totals.size() < 3 || std::chrono::duration<double>(Clock::now() - start).count() < minTime) {
+    NullWriter writer;
+    enc.encode(input.data.data(), input.params, writer);
+    totals.push_back(seconds(stats.totalTime));
+    converts.push_back(seconds(stats.conversionTime));
+    compresses.push_back(seconds(stats.compressionTime));
+  }
+
+  input.params.stats = nullptr;
+  return {median(totals), median(converts), median(compresses), size_t(stats.bytesOut)};
+}
+
+static bool in_list(const std::string& list, const char* name) {
+  if (list.empty()) return true;
+
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) end = list.size();
+    if (list.compare(start, end - start, name) == 0) return true;
+    start = end + 1;
+  }
+  return false;
+}
+
+int main(int argc, char** argv) {
+  std::string sizeList, formatList;
+  double minTime = 0.5;
+  bool json = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--sizes" && i + 1 < argc) sizeList = argv[++i];
+    else if (arg == "--formats" && i + 1 < argc) formatList = argv[++i];
+    else if (arg == "--min-time" && i + 1 < argc) minTime = std::stod(argv[++i]);
+    else if (arg == "--json") json = true;
+    else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--sizes thumb,1mp,24mp,100mp] [--formats u8,u16,f16,u32,f32,u64,f64]"
+                   " [--min-time seconds] [--json]\n";
+      return 1;
+    }
+  }
+
+  jpeg::Encoder enc;
+  bool first = true;
+
+  if (json) std::cout << "{\"results\": [";
+  std::fprintf(
+    stderr, "%-6s %-5s %-8s %-5s %10s %10s %10s %10s %10s\n",
+    "size", "fmt", "layout", "mode", "total ms", "conv ms", "comp ms", "MP/s", "MB/s in"
+  );
+
+  for (const Size& size: sizes) {
+    if (!in_list(sizeList, size.name)) continue;
+
+    for (jpeg::ColorMode mode: {jpeg::ColorMode::RGB, jpeg::ColorMode::Grayscale}) {
+      const char* modeName = mode == jpeg::ColorMode::RGB ? "rgb" : "gray";
+
+      for (const Format& format: formats) {
+        if (!in_list(formatList, format.name)) continue;
+
+        for (Layout layout: {Layout::Packed, Layout::Strided, Layout::Sliced, Layout::Planar, Layout::Tiled}) {
+          Input input = make_input(format.format, layout, mode, size);
+
+          const Timing timing = time_encode(enc, input, minTime);
+          const double total = timing.total;
+
+          const double megapixels = double(size.width) * size.height / 1e6;
+          const double bytesIn = double(size.width) * size.height * (mode == jpeg::ColorMode::RGB ? 3 : 1)
+                                 * input.params.channelStride();
+
+          std::fprintf(
+            stderr, "%-6s %-5s %-8s %-5s %10.2f %10.2f %10.2f %10.1f %10.1f\n",
+            size.name, format.name, layout_name(layout), modeName,
+            total * 1e3, timing.convert * 1e3, timing.compress * 1e3, megapixels / total, bytesIn / total / 1e6
+          );
+
+          if (json) {
+            std::cout << (first ? "\n" : ",\n") << "  {"
+                      << "\"size\": \"" << size.name << "\", "
+                      << "\"width\": " << size.width << ", "
+                      << "\"height\": " << size.height << ", "
+                      << "\"format\": \"" << format.name << "\", "
+                      << "\"layout\": \"" << layout_name(layout) << "\", "
+                      << "\"mode\": \"" << modeName << "\", "
+                      << "\"total_s\": " << total << ", "
+                      << "\"convert_s\": " << timing.convert << ", "
+                      << "\"compress_s\": " << timing.compress << ", "
+                      << "\"megapixels_per_s\": " << megapixels / total << ", "
+                      << "\"bytes_in\": " << size_t(bytesIn) << ", "
+                      << "\"bytes_out\": " << timing.bytesOut << ", "
+                      << "\"bytes_per_s\": " << bytesIn / total
+                      << "}";
+            first = false;
+          }
+        }
+      }
+    }
+  }
+
+  if (json) std::cout << "\n]}\n";
+}
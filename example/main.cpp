@@ -82,6 +82,17 @@ int main() {
     }
   );
 
+  // Linear-light Display P3 floats, converted to sRGB while encoding
+  enc.encode(
+    dataF.data(), {
+      .width = size,
+      .height = size,
+      .pixelFormat = jpeg::PixelFormat::Float32,
+      .linearInput = jpeg::ColorSpace::DisplayP3,
+      .outPath = fs::current_path() / "out_linear.jpeg",
+    }
+  );
+
   // Half precision float pixel format
   std::vector<uint16_t> dataF16(size * size * 3);
   for (uint32_t i = 0; i < size; i++) {
@@ -113,6 +124,24 @@ int main() {
     }
   );
 
+  // Highest quality up to 90 that fits in 100 KB
+  enc.encode(
+    data.data(), {
+      .width = size,
+      .height = size,
+      .compression = {.quality = 90, .targetBytes = 100 * 1024},
+      .outPath = fs::current_path() / "out_target.jpeg",
+    }
+  );
+
+  // Incremental encode, writing rows as they're produced
+  jpeg::FileWriter writer(fs::current_path() / "out_session.jpeg");
+  auto session = enc.begin({.width = size, .height = size}, writer);
+  for (uint32_t i = 0; i < size; i += 64) {
+    session.writeRows(data.data() + i * size * 3, 64);
+  }
+  session.finish();
+
   enc.encode(
     data.data(), {
       .width = size,
@@ -123,4 +152,21 @@ int main() {
       .outPath = fs::current_path() / "out_gray.jpeg",
     }
   );
+
+  // Decode a thumbnail at 1/8 scale and encode it again
+  jpeg::Decoder dec;
+  std::vector<uint8_t> thumb;
+  auto info = dec.decode(fs::current_path() / "out.jpeg", thumb, {.scaleDenom = 8});
+  enc.encode(
+    thumb.data(), {
+      .width = info.width,
+      .height = info.height,
+      .outPath = fs::current_path() / "out_thumb.jpeg",
+    }
+  );
+
+  // Rotate without decoding
+  jpeg::Transformer transformer;
+  jpeg::FileWriter rotatedWriter(fs::current_path() / "out_rotated.jpeg");
+  transformer.transform(fs::current_path() / "out.jpeg", {.transform = jpeg::Transform::Rotate90}, rotatedWriter);
 }
@@ -1,197 +1,4125 @@
 #include "simple_jpeg.hpp"
 
-#define min(x, y) ((x) < (y)) ? (x) : (y)
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <latch>
+#include <system_error>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <jerror.h>
+
+#if !defined(SIMPLEJPEG_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define SIMPLEJPEG_X86_SIMD
+#include <immintrin.h>
+#define SIMPLEJPEG_TARGET(isa) __attribute__((target(isa)))
+#endif
 
 namespace jpeg {
 
-namespace icc_data {
+using Clock = std::chrono::steady_clock;
+
+namespace icc_data {
+
+#include <resource/icc/srgb.h>
+#include <resource/icc/display_p3.h>
+
+}
+
+/*
+ * IEEE-754 half-precision float to 8bpc conversion, quantizing the same way as
+ * floating point input: values outside [0, 1) saturate and NaN maps to white
+ * Works on the bits directly: a normalized value below 1 times 256 is its
+ * mantissa with the implicit bit shifted by the exponent, and denormals are
+ * all below 1/256.
+ */
+static constexpr uint8_t half_to_uint8(const uint16_t x) {
+  const uint32_t e = (x & 0x7C00) >> 10; // exponent
+  const uint32_t m = x & 0x03FF; // mantissa
+  if (e == 0x1F && m != 0) return 255; // NaN, matching F16C
+  if (x & 0x8000) return 0; // negative
+  if (e >= 15) return 255; // 1.0 and above, infinity
+  if (e == 0) return 0; // zero and denormalized
+  return uint8_t((0x400 | m) >> (17 - e));
+}
+
+/*
+ * Row conversion kernels
+ * Each kernel converts a single row of input pixels to the packed 8bpc layout
+ * libjpeg expects. Kernels are selected once per encode based on the pixel
+ * format and channel layout, so the per-sample work is free of any dispatch.
+ */
+struct RowLayout {
+  // Number of channels in the input data
+  uint32_t inChannels;
+  // Number of components written per pixel (libjpeg input_components)
+  uint32_t components;
+  // Size of a single channel, in bytes
+  uint32_t channelStride;
+  // Distance between consecutive pixels, in bytes
+  uint32_t pixelStride;
+  // 64K entry lookup table for Uint16 input with a tone curve, or null
+  const uint8_t* toneCurve = nullptr;
+  // Linear-light input, encoded with the sRGB transfer curve while converting
+  bool linear = false;
+  // Row-major matrix converting linear input to the output gamut, or null
+  const float* gamutMatrix = nullptr;
+};
+
+/*
+ * Row conversion function
+ * src points to the first channel to read of the first pixel in the row, with
+ * all offsets already applied.
+ */
+using RowConverter = void (*)(const uint8_t* src, uint8_t* dst, uint32_t width, const RowLayout& layout);
+
+/*
+ * Row conversion function for planar RGB input
+ * planes holds the first sample of the row in each of the three planes.
+ */
+using PlanarConverter = void (*)(const uint8_t* const* planes, uint8_t* dst, uint32_t width, const RowLayout& layout);
+
+template<PixelFormat Format>
+struct SampleTraits;
+
+template<>
+struct SampleTraits<PixelFormat::Uint8> {
+  using type = uint8_t;
+
+  // This is the simplest operation: just copy the data per channel
+  static uint8_t convert(uint8_t v) { return v; }
+  static uint8_t expand(uint8_t v) { return v; }
+};
+
+// For >8bit integer formats, simply dump the lower bits
+// TODO: possibly add dithering support?
+template<>
+struct SampleTraits<PixelFormat::Uint16> {
+  using type = uint16_t;
+
+  static uint8_t convert(uint16_t v) { return uint8_t(v >> 8); }
+  // When decoding, repeat the bits so the full range is covered
+  static uint16_t expand(uint8_t v) { return uint16_t(v * 0x0101u); }
+};
+
+template<>
+struct SampleTraits<PixelFormat::Uint32> {
+  using type = uint32_t;
+
+  static uint8_t convert(uint32_t v) { return uint8_t(v >> 24); }
+  static uint32_t expand(uint8_t v) { return v * 0x01010101u; }
+};
+
+template<>
+struct SampleTraits<PixelFormat::Uint64> {
+  using type = uint64_t;
+
+  static uint8_t convert(uint64_t v) { return uint8_t(v >> 56); }
+  static uint64_t expand(uint8_t v) { return v * 0x0101010101010101ull; }
+};
+
+// Values outside [0, 1) saturate, NaN maps to white like the SIMD kernels do
+template<typename T>
+static uint8_t quantize(T v) {
+  v *= 256;
+  if (!(v < 255)) return 255;
+  return v > 0 ? uint8_t(v) : 0;
+}
+
+/*
+ * There are only 64K half values, so the scalar path looks every one of them up
+ * in a table generated at compile time instead of converting and quantizing.
+ * Results are identical to the F16C kernels, including for NaN and infinity.
+ */
+static constexpr auto half_table = [] {
+  std::array<uint8_t, 65536> table{};
+  for (uint32_t i = 0; i < table.size(); i++) table[i] = half_to_uint8(uint16_t(i));
+  return table;
+}();
+
+/*
+ * 8bpc to half-precision float as v / 255, for decoding. Every nonzero value is
+ * a normalized half. Where the nearest half would convert back to a different
+ * 8bpc value, the neighbouring half is used instead, so decoded images encode to
+ * the same 8bpc values.
+ */
+static constexpr uint16_t uint8_to_half(const uint8_t v) {
+  if (v == 0) return 0;
+
+  double x = v / 255.0;
+  int e = 0;
+  while (x < 1) {
+    x *= 2;
+    e--;
+  }
+  // Round the mantissa to nearest, where a carry bumps the exponent
+  const uint16_t half = uint16_t(((e + 15) << 10) + uint32_t((x - 1) * 1024 + 0.5));
+  if (half_to_uint8(half) < v) return half + 1;
+  if (half_to_uint8(half) > v) return half - 1;
+  return half;
+}
+
+static constexpr auto half_from_uint8_table = [] {
+  std::array<uint16_t, 256> table{};
+  for (uint32_t i = 0; i < table.size(); i++) table[i] = uint8_to_half(uint8_t(i));
+  return table;
+}();
+
+template<>
+struct SampleTraits<PixelFormat::Float16> {
+  using type = uint16_t;
+
+  static uint8_t convert(uint16_t v) { return half_table[v]; }
+  static uint16_t expand(uint8_t v) { return half_from_uint8_table[v]; }
+};
+
+template<>
+struct SampleTraits<PixelFormat::Float32> {
+  using type = float;
+
+  static uint8_t convert(float v) { return quantize(v); }
+  static float expand(uint8_t v) { return float(v) / 255.0f; }
+};
+
+template<>
+struct SampleTraits<PixelFormat::Float64> {
+  using type = double;
+
+  static uint8_t convert(double v) { return quantize(v); }
+  static double expand(uint8_t v) { return double(v) / 255.0; }
+};
+
+template<PixelFormat Format>
+static uint8_t load_sample(const uint8_t* ptr) {
+  typename SampleTraits<Format>::type v;
+  std::memcpy(&v, ptr, sizeof(v));
+  return SampleTraits<Format>::convert(v);
+}
+
+/*
+ * Specialized kernel for tightly packed pixels, with the channel count and
+ * component count known at compile time
+ */
+template<PixelFormat Format, uint32_t InChannels, uint32_t Components>
+static void convert_row_packed(const uint8_t* src, uint8_t* dst, uint32_t width, const RowLayout&) {
+  constexpr size_t sampleSize = sizeof(typename SampleTraits<Format>::type);
+  constexpr size_t pixelStride = sampleSize * InChannels;
+
+  for (uint32_t iPixel = 0; iPixel < width; iPixel++) {
+    for (uint32_t iChannel = 0; iChannel < Components; iChannel++) {
+      dst[iChannel] = load_sample<Format>(src + iChannel * sampleSize);
+    }
+    src += pixelStride;
+    dst += Components;
+  }
+}
+
+/*
+ * Generic fallback kernel for arbitrary pixel strides
+ */
+template<PixelFormat Format>
+static void convert_row_strided(const uint8_t* src, uint8_t* dst, uint32_t width, const RowLayout& layout) {
+  for (uint32_t iPixel = 0; iPixel < width; iPixel++) {
+    for (uint32_t iChannel = 0; iChannel < layout.components; iChannel++) {
+      dst[iChannel] = load_sample<Format>(src + iChannel * layout.channelStride);
+    }
+    src += layout.pixelStride;
+    dst += layout.components;
+  }
+}
+
+/*
+ * Kernel for Uint16 input mapped through a tone curve table, for any layout
+ */
+template<uint32_t Components>
+static void convert_row_tone_curve(const uint8_t* src, uint8_t* dst, uint32_t width, const RowLayout& layout) {
+  for (uint32_t iPixel = 0; iPixel < width; iPixel++) {
+    for (uint32_t iChannel = 0; iChannel < Components; iChannel++) {
+      uint16_t v;
+      std::memcpy(&v, src + iChannel * sizeof(v), sizeof(v));
+      dst[iChannel] = layout.toneCurve[v];
+    }
+    src += layout.pixelStride;
+    dst += Components;
+  }
+}
+
+/*
+ * Kernels for planar RGB input
+ */
+template<PixelFormat Format>
+static void convert_planes_scalar(const uint8_t* const* planes, uint8_t* dst, uint32_t width, const RowLayout&) {
+  constexpr size_t sampleSize = sizeof(typename SampleTraits<Format>::type);
+
+  for (uint32_t iPixel = 0; iPixel < width; iPixel++) {
+    for (uint32_t iChannel = 0; iChannel < 3; iChannel++) {
+      dst[iChannel] = load_sample<Format>(planes[iChannel] + iPixel * sampleSize);
+    }
+    dst += 3;
+  }
+}
+
+static void convert_planes_tone_curve(const uint8_t* const* planes, uint8_t* dst, uint32_t width, const RowLayout& layout) {
+  for (uint32_t iPixel = 0; iPixel < width; iPixel++) {
+    for (uint32_t iChannel = 0; iChannel < 3; iChannel++) {
+      uint16_t v;
+      std::memcpy(&v, planes[iChannel] + iPixel * sizeof(v), sizeof(v));
+      dst[iChannel] = layout.toneCurve[v];
+    }
+    dst += 3;
+  }
+}
+
+/*
+ * Linear input
+ * Samples are loaded as floats, converted to the output gamut and written to a
+ * small buffer on the stack in chunks, which a transfer kernel then encodes to
+ * 8bpc while it's in L1.
+ */
+using LinearSpan = void (*)(const float* src, uint8_t* dst, size_t count);
+
+// Scaling the exponent with a multiply handles denormals as well
+static float half_to_float(uint16_t h) {
+  const uint32_t sign = uint32_t(h & 0x8000) << 16;
+  const uint32_t magnitude = uint32_t(h & 0x7FFF) << 13;
+
+  float v;
+  if (magnitude >= 0x7C00u << 13) {
+    const uint32_t bits = sign | 0x7F800000 | magnitude;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+
+  std::memcpy(&v, &magnitude, sizeof(v));
+  v *= 0x1p112f;
+  return sign ? -v : v;
+}
+
+template<PixelFormat Format>
+static float load_linear(const uint8_t* ptr) {
+  typename SampleTraits<Format>::type v;
+  std::memcpy(&v, ptr, sizeof(v));
+  if constexpr (Format == PixelFormat::Float16) return half_to_float(v);
+  else return float(v);
+}
+
+/*
+ * sRGB transfer curve (shared by Display P3)
+ * Above the linear segment, x^(1/2.4) is split into 2^(-5j/12) for the
+ * exponent -j of x, from a table, and m^(5/12) for its mantissa m in [1, 2),
+ * from a polynomial, which is accurate to 3e-7. The encoded value is quantized
+ * the same way as encoded float input. Input is clamped to [0, 1] first, with
+ * NaN mapping to white.
+ */
+static constexpr float srgb_linear_limit = 0.0031308f;
+
+static constexpr float srgb_exponent_scale[16] = {
+  1.0f, 0.749153538f, 0.561231024f, 0.420448208f, 0.314980262f, 0.235968578f, 0.176776695f, 0.132432887f,
+  0.0992125657f, 0.0743254447f, 0.0556811699f, 0.0417137454f, 0.03125f, 0.0234110481f, 0.0175384695f, 0.0131390065f,
+};
+
+// Chebyshev fit of m^(5/12) on [1, 2], in powers of m - 1
+static constexpr float srgb_mantissa_poly[7] = {
+  1.00000024f, 0.416642578f, -0.121126615f, 0.0615321899f, -0.032827172f, 0.0133100173f, -0.00269152573f,
+};
+
+static uint8_t linear_to_srgb(float v) {
+  v = v < 1.0f ? v : 1.0f;
+  v = v > 0.0f ? v : 0.0f;
+  if (v <= srgb_linear_limit) return quantize(v * 12.92f);
+
+  uint32_t bits;
+  std::memcpy(&bits, &v, sizeof(bits));
+  const uint32_t exponent = 127 - (bits >> 23);
+  const uint32_t mantissaBits = (bits & 0x007FFFFF) | 0x3F800000;
+  float m;
+  std::memcpy(&m, &mantissaBits, sizeof(m));
+
+  const float t = m - 1.0f;
+  float p = srgb_mantissa_poly[6];
+  for (int i = 5; i >= 0; i--) p = p * t + srgb_mantissa_poly[i];
+
+  return quantize(1.055f * (p * srgb_exponent_scale[exponent]) - 0.055f);
+}
+
+static void linear_to_srgb_scalar(const float* src, uint8_t* dst, size_t count) {
+  for (size_t i = 0; i < count; i++) dst[i] = linear_to_srgb(src[i]);
+}
+
+/*
+ * Matrix converting linear RGB from one gamut to another, or null when they're
+ * the same. Derived from the primaries of each color space, both D65.
+ */
+static const float* gamut_matrix(ColorSpace from, ColorSpace to) {
+  static constexpr float displayP3ToSrgb[9] = {
+    1.2249402f, -0.2249402f, 0.0f,
+    -0.0420570f, 1.0420570f, 0.0f,
+    -0.0196376f, -0.0786360f, 1.0982736f,
+  };
+  static constexpr float srgbToDisplayP3[9] = {
+    0.8224620f, 0.1775380f, 0.0f,
+    0.0331942f, 0.9668058f, 0.0f,
+    0.0170826f, 0.0723974f, 0.9105199f,
+  };
+
+  if (from == to) return nullptr;
+  return from == ColorSpace::DisplayP3 ? displayP3ToSrgb : srgbToDisplayP3;
+}
+
+template<bool Matrix>
+static void to_output_gamut(float* rgb, const float* matrix) {
+  if constexpr (Matrix) {
+    const float r = rgb[0], g = rgb[1], b = rgb[2];
+    rgb[0] = matrix[0] * r + matrix[1] * g + matrix[2] * b;
+    rgb[1] = matrix[3] * r + matrix[4] * g + matrix[5] * b;
+    rgb[2] = matrix[6] * r + matrix[7] * g + matrix[8] * b;
+  }
+}
+
+/*
+ * Kernel for packed or strided linear input. InChannels is the channel count
+ * of packed pixels, or 0 to use the pixel stride of the layout.
+ */
+template<PixelFormat Format, uint32_t InChannels, uint32_t Components, bool Matrix, LinearSpan Encode>
+static void convert_row_linear(const uint8_t* src, uint8_t* dst, uint32_t width, const RowLayout& layout) {
+  constexpr size_t sampleSize = sizeof(typename SampleTraits<Format>::type);
+  constexpr uint32_t chunkPixels = 64;
+  const size_t pixelStride = InChannels ? InChannels * sampleSize : layout.pixelStride;
+  float chunk[chunkPixels * Components];
+
+  for (uint32_t iPixel = 0; iPixel < width; iPixel += chunkPixels) {
+    const uint32_t nPixels = std::min(chunkPixels, width - iPixel);
+    for (uint32_t i = 0; i < nPixels; i++) {
+      const uint8_t* pixel = src + size_t(iPixel + i) * pixelStride;
+      float* linear = chunk + i * Components;
+      for (uint32_t iChannel = 0; iChannel < Components; iChannel++) {
+        linear[iChannel] = load_linear<Format>(pixel + iChannel * sampleSize);
+      }
+      to_output_gamut<Matrix>(linear, layout.gamutMatrix);
+    }
+    Encode(chunk, dst + size_t(iPixel) * Components, size_t(nPixels) * Components);
+  }
+}
+
+template<PixelFormat Format, bool Matrix, LinearSpan Encode>
+static void convert_planes_linear(const uint8_t* const* planes, uint8_t* dst, uint32_t width, const RowLayout& layout) {
+  constexpr size_t sampleSize = sizeof(typename SampleTraits<Format>::type);
+  constexpr uint32_t chunkPixels = 64;
+  float chunk[chunkPixels * 3];
+
+  for (uint32_t iPixel = 0; iPixel < width; iPixel += chunkPixels) {
+    const uint32_t nPixels = std::min(chunkPixels, width - iPixel);
+    for (uint32_t i = 0; i < nPixels; i++) {
+      float* linear = chunk + i * 3;
+      for (uint32_t iChannel = 0; iChannel < 3; iChannel++) {
+        linear[iChannel] = load_linear<Format>(planes[iChannel] + size_t(iPixel + i) * sampleSize);
+      }
+      to_output_gamut<Matrix>(linear, layout.gamutMatrix);
+    }
+    Encode(chunk, dst + size_t(iPixel) * 3, size_t(nPixels) * 3);
+  }
+}
+
+template<PixelFormat Format, uint32_t Components>
+static RowConverter select_packed_converter(uint32_t inChannels) {
+  // Layouts with fewer input channels than components are left to the strided
+  // kernel, which reads past the pixel stride the same way
+  switch (inChannels) {
+    case 1: if constexpr (Components <= 1) return convert_row_packed<Format, 1, Components>;
+      break;
+    case 2: if constexpr (Components <= 2) return convert_row_packed<Format, 2, Components>;
+      break;
+    case 3: return convert_row_packed<Format, 3, Components>;
+    case 4: return convert_row_packed<Format, 4, Components>;
+    default: break;
+  }
+
+  return nullptr;
+}
+
+#ifdef SIMPLEJPEG_X86_SIMD
+
+/*
+ * SIMD conversion kernels
+ * Span kernels convert a contiguous run of samples to 8bpc, and are wrapped in
+ * row kernels for the packed layouts. The instruction set is chosen at runtime
+ * based on what the CPU supports; anything not covered here (odd strides,
+ * channel extraction) is left to the scalar kernels.
+ */
+using SpanConverter = void (*)(const uint8_t* src, uint8_t* dst, size_t count);
+
+struct CpuFeatures {
+  bool sse41 = false;
+  bool avx2 = false;
+  bool f16c = false;
+  bool avx512f = false;
+};
+
+static const CpuFeatures& cpu_features() {
+  static const CpuFeatures features = [] {
+    __builtin_cpu_init();
+    return CpuFeatures{
+      .sse41 = bool(__builtin_cpu_supports("sse4.1")),
+      .avx2 = bool(__builtin_cpu_supports("avx2")),
+      .f16c = bool(__builtin_cpu_supports("f16c")),
+      .avx512f = bool(__builtin_cpu_supports("avx512f")),
+    };
+  }();
+  return features;
+}
+
+template<PixelFormat Format>
+static void convert_span_scalar(const uint8_t* src, uint8_t* dst, size_t count) {
+  constexpr size_t sampleSize = sizeof(typename SampleTraits<Format>::type);
+  for (size_t i = 0; i < count; i++) dst[i] = load_sample<Format>(src + i * sampleSize);
+}
+
+/*
+ * SSE4.1
+ */
+SIMPLEJPEG_TARGET("sse4.1")
+static __m128i quantize_sse41(__m128 v) {
+  v = _mm_min_ps(_mm_mul_ps(v, _mm_set1_ps(256.0f)), _mm_set1_ps(255.0f));
+  return _mm_cvttps_epi32(v);
+}
+
+SIMPLEJPEG_TARGET("sse4.1")
+static void convert_span_u16_sse41(const uint8_t* src, uint8_t* dst, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i a = _mm_srli_epi16(_mm_loadu_si128((const __m128i*) (src + i * 2)), 8);
+    __m128i b = _mm_srli_epi16(_mm_loadu_si128((const __m128i*) (src + i * 2 + 16)), 8);
+    _mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(a, b));
+  }
+  convert_span_scalar<PixelFormat::Uint16>(src + i * 2, dst + i, count - i);
+}
+
+SIMPLEJPEG_TARGET("sse4.1")
+static void convert_span_f32_sse41(const uint8_t* src, uint8_t* dst, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const float* p = (const float*) (src + i * 4);
+    __m128i a = quantize_sse41(_mm_loadu_ps(p));
+    __m128i b = quantize_sse41(_mm_loadu_ps(p + 4));
+    __m128i c = quantize_sse41(_mm_loadu_ps(p + 8));
+    __m128i d = quantize_sse41(_mm_loadu_ps(p + 12));
+    __m128i packed = _mm_packus_epi16(_mm_packus_epi32(a, b), _mm_packus_epi32(c, d));
+    _mm_storeu_si128((__m128i*) (dst + i), packed);
+  }
+  convert_span_scalar<PixelFormat::Float32>(src + i * 4, dst + i, count - i);
+}
+
+SIMPLEJPEG_TARGET("sse4.1,f16c")
+static void convert_span_f16_sse41(const uint8_t* src, uint8_t* dst, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const uint8_t* p = src + i * 2;
+    __m128i a = quantize_sse41(_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*) p)));
+    __m128i b = quantize_sse41(_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*) (p + 8))));
+    __m128i c = quantize_sse41(_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*) (p + 16))));
+    __m128i d = quantize_sse41(_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*) (p + 24))));
+    __m128i packed = _mm_packus_epi16(_mm_packus_epi32(a, b), _mm_packus_epi32(c, d));
+    _mm_storeu_si128((__m128i*) (dst + i), packed);
+  }
+  convert_span_scalar<PixelFormat::Float16>(src + i * 2, dst + i, count - i);
+}
+
+/*
+ * AVX2
+ * The tails of wider kernels fall through to narrower ones compiled without
+ * VEX encoding, so the upper register halves are cleared first to avoid AVX-SSE
+ * transition penalties.
+ */
+SIMPLEJPEG_TARGET("avx2")
+static __m256i quantize_avx2(__m256 v) {
+  v = _mm256_min_ps(_mm256_mul_ps(v, _mm256_set1_ps(256.0f)), _mm256_set1_ps(255.0f));
+  return _mm256_cvttps_epi32(v);
+}
+
+// Packs 32 int32 values to bytes, undoing the per-lane interleaving of the packs
+SIMPLEJPEG_TARGET("avx2")
+static __m256i pack_epi32_avx2(__m256i a, __m256i b, __m256i c, __m256i d) {
+  __m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(a, b), _mm256_packus_epi32(c, d));
+  return _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+SIMPLEJPEG_TARGET("avx2")
+static void convert_span_u16_avx2(const uint8_t* src, uint8_t* dst, size_t count) {
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i a = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*) (src + i * 2)), 8);
+    __m256i b = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*) (src + i * 2 + 32)), 8);
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0b11011000);
+    _mm256_storeu_si256((__m256i*) (dst + i), packed);
+  }
+  _mm256_zeroupper();
+  convert_span_u16_sse41(src + i * 2, dst + i, count - i);
+}
+
+SIMPLEJPEG_TARGET("avx2")
+static void convert_span_f32_avx2(const uint8_t* src, uint8_t* dst, size_t count) {
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    const float* p = (const float*) (src + i * 4);
+    __m256i a = quantize_avx2(_mm256_loadu_ps(p));
+    __m256i b = quantize_avx2(_mm256_loadu_ps(p + 8));
+    __m256i c = quantize_avx2(_mm256_loadu_ps(p + 16));
+    __m256i d = quantize_avx2(_mm256_loadu_ps(p + 24));
+    _mm256_storeu_si256((__m256i*) (dst + i), pack_epi32_avx2(a, b, c, d));
+  }
+  _mm256_zeroupper();
+  convert_span_f32_sse41(src + i * 4, dst + i, count - i);
+}
+
+SIMPLEJPEG_TARGET("avx2,f16c")
+static void convert_span_f16_avx2(const uint8_t* src, uint8_t* dst, size_t count) {
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    const __m128i* p = (const __m128i*) (src + i * 2);
+    __m256i a = quantize_avx2(_mm256_cvtph_ps(_mm_loadu_si128(p)));
+    __m256i b = quantize_avx2(_mm256_cvtph_ps(_mm_loadu_si128(p + 1)));
+    __m256i c = quantize_avx2(_mm256_cvtph_ps(_mm_loadu_si128(p + 2)));
+    __m256i d = quantize_avx2(_mm256_cvtph_ps(_mm_loadu_si128(p + 3)));
+    _mm256_storeu_si256((__m256i*) (dst + i), pack_epi32_avx2(a, b, c, d));
+  }
+  _mm256_zeroupper();
+  convert_span_f16_sse41(src + i * 2, dst + i, count - i);
+}
+
+/*
+ * AVX-512
+ */
+SIMPLEJPEG_TARGET("avx512f")
+static __m128i quantize_avx512(__m512 v) {
+  v = _mm512_min_ps(_mm512_mul_ps(v, _mm512_set1_ps(256.0f)), _mm512_set1_ps(255.0f));
+  __m512i i = _mm512_max_epi32(_mm512_cvttps_epi32(v), _mm512_setzero_si512());
+  return _mm512_cvtepi32_epi8(i);
+}
+
+SIMPLEJPEG_TARGET("avx512f,avx2")
+static void convert_span_u16_avx512(const uint8_t* src, uint8_t* dst, size_t count) {
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    const __m256i* p = (const __m256i*) (src + i * 2);
+    __m512i a = _mm512_srli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256(p)), 8);
+    __m512i b = _mm512_srli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256(p + 1)), 8);
+    _mm_storeu_si128((__m128i*) (dst + i), _mm512_cvtepi32_epi8(a));
+    _mm_storeu_si128((__m128i*) (dst + i + 16), _mm512_cvtepi32_epi8(b));
+  }
+  _mm256_zeroupper();
+  convert_span_u16_avx2(src + i * 2, dst + i, count - i);
+}
+
+SIMPLEJPEG_TARGET("avx512f,avx2")
+static void convert_span_f32_avx512(const uint8_t* src, uint8_t* dst, size_t count) {
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    const float* p = (const float*) (src + i * 4);
+    _mm_storeu_si128((__m128i*) (dst + i), quantize_avx512(_mm512_loadu_ps(p)));
+    _mm_storeu_si128((__m128i*) (dst + i + 16), quantize_avx512(_mm512_loadu_ps(p + 16)));
+  }
+  _mm256_zeroupper();
+  convert_span_f32_avx2(src + i * 4, dst + i, count - i);
+}
+
+SIMPLEJPEG_TARGET("avx512f,avx2,f16c")
+static void convert_span_f16_avx512(const uint8_t* src, uint8_t* dst, size_t count) {
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    const __m256i* p = (const __m256i*) (src + i * 2);
+    _mm_storeu_si128((__m128i*) (dst + i), quantize_avx512(_mm512_cvtph_ps(_mm256_loadu_si256(p))));
+    _mm_storeu_si128((__m128i*) (dst + i + 16), quantize_avx512(_mm512_cvtph_ps(_mm256_loadu_si256(p + 1))));
+  }
+  _mm256_zeroupper();
+  convert_span_f16_avx2(src + i * 2, dst + i, count - i);
+}
+
+/*
+ * Linear input, AVX2
+ * Same operations as the scalar version, so results are identical. The two
+ * halves of the exponent table are looked up with permutes.
+ */
+SIMPLEJPEG_TARGET("avx2")
+static __m256i linear_to_srgb_avx2(__m256 v) {
+  // min returns its second operand for NaN, like the scalar comparison
+  v = _mm256_max_ps(_mm256_min_ps(v, _mm256_set1_ps(1.0f)), _mm256_setzero_ps());
+
+  const __m256i bits = _mm256_castps_si256(v);
+  const __m256i exponent = _mm256_sub_epi32(_mm256_set1_epi32(127), _mm256_srli_epi32(bits, 23));
+  const __m256 scale = _mm256_blendv_ps(
+    _mm256_permutevar8x32_ps(_mm256_loadu_ps(srgb_exponent_scale), exponent),
+    _mm256_permutevar8x32_ps(_mm256_loadu_ps(srgb_exponent_scale + 8), exponent),
+    _mm256_castsi256_ps(_mm256_cmpgt_epi32(exponent, _mm256_set1_epi32(7)))
+  );
+
+  const __m256i mantissaBits = _mm256_or_si256(
+    _mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)), _mm256_set1_epi32(0x3F800000)
+  );
+  const __m256 t = _mm256_sub_ps(_mm256_castsi256_ps(mantissaBits), _mm256_set1_ps(1.0f));
+  __m256 p = _mm256_set1_ps(srgb_mantissa_poly[6]);
+  for (int i = 5; i >= 0; i--) p = _mm256_add_ps(_mm256_mul_ps(p, t), _mm256_set1_ps(srgb_mantissa_poly[i]));
+
+  const __m256 curve = _mm256_sub_ps(
+    _mm256_mul_ps(_mm256_set1_ps(1.055f), _mm256_mul_ps(p, scale)), _mm256_set1_ps(0.055f)
+  );
+  const __m256 linear = _mm256_mul_ps(v, _mm256_set1_ps(12.92f));
+  const __m256 encoded = _mm256_blendv_ps(
+    curve, linear, _mm256_cmp_ps(v, _mm256_set1_ps(srgb_linear_limit), _CMP_LE_OQ)
+  );
+  return quantize_avx2(encoded);
+}
+
+SIMPLEJPEG_TARGET("avx2")
+static void linear_to_srgb_span_avx2(const float* src, uint8_t* dst, size_t count) {
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i a = linear_to_srgb_avx2(_mm256_loadu_ps(src + i));
+    __m256i b = linear_to_srgb_avx2(_mm256_loadu_ps(src + i + 8));
+    __m256i c = linear_to_srgb_avx2(_mm256_loadu_ps(src + i + 16));
+    __m256i d = linear_to_srgb_avx2(_mm256_loadu_ps(src + i + 24));
+    _mm256_storeu_si256((__m256i*) (dst + i), pack_epi32_avx2(a, b, c, d));
+  }
+  _mm256_zeroupper();
+  linear_to_srgb_scalar(src + i, dst + i, count - i);
+}
+
+/*
+ * Drops every fourth byte, turning 8bpc RGBA (or any 4 channel layout) into RGB
+ */
+SIMPLEJPEG_TARGET("sse4.1")
+static void drop_fourth_channel_sse41(const uint8_t* src, uint8_t* dst, size_t nPixels) {
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+  size_t i = 0;
+  for (; i + 4 <= nPixels; i += 4) {
+    __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (src + i * 4)), shuffle);
+    _mm_storel_epi64((__m128i*) (dst + i * 3), v);
+    uint32_t tail = _mm_extract_epi32(v, 2);
+    std::memcpy(dst + i * 3 + 8, &tail, sizeof(tail));
+  }
+  for (; i < nPixels; i++) {
+    dst[i * 3 + 0] = src[i * 4 + 0];
+    dst[i * 3 + 1] = src[i * 4 + 1];
+    dst[i * 3 + 2] = src[i * 4 + 2];
+  }
+}
+
+/*
+ * Interleaves three planes of 8bpc samples into packed RGB, 16 pixels at a time
+ * Output byte i of each 48 byte block comes from channel i % 3 of pixel i / 3.
+ */
+SIMPLEJPEG_TARGET("sse4.1")
+static void interleave_planes_sse41(const uint8_t* r, const uint8_t* g, const uint8_t* b, uint8_t* dst, size_t nPixels) {
+  const __m128i r0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+  const __m128i g0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+  const __m128i b0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+  const __m128i r1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+  const __m128i g1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+  const __m128i b1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+  const __m128i r2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+  const __m128i g2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+  const __m128i b2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+
+  size_t i = 0;
+  for (; i + 16 <= nPixels; i += 16) {
+    const __m128i vr = _mm_loadu_si128((const __m128i*) (r + i));
+    const __m128i vg = _mm_loadu_si128((const __m128i*) (g + i));
+    const __m128i vb = _mm_loadu_si128((const __m128i*) (b + i));
+    __m128i* out = (__m128i*) (dst + i * 3);
+    _mm_storeu_si128(out, _mm_or_si128(
+      _mm_or_si128(_mm_shuffle_epi8(vr, r0), _mm_shuffle_epi8(vg, g0)), _mm_shuffle_epi8(vb, b0)
+    ));
+    _mm_storeu_si128(out + 1, _mm_or_si128(
+      _mm_or_si128(_mm_shuffle_epi8(vr, r1), _mm_shuffle_epi8(vg, g1)), _mm_shuffle_epi8(vb, b1)
+    ));
+    _mm_storeu_si128(out + 2, _mm_or_si128(
+      _mm_or_si128(_mm_shuffle_epi8(vr, r2), _mm_shuffle_epi8(vg, g2)), _mm_shuffle_epi8(vb, b2)
+    ));
+  }
+  for (; i < nPixels; i++) {
+    dst[i * 3 + 0] = r[i];
+    dst[i * 3 + 1] = g[i];
+    dst[i * 3 + 2] = b[i];
+  }
+}
+
+SIMPLEJPEG_TARGET("sse4.1")
+static void convert_planes_u8_sse41(const uint8_t* const* planes, uint8_t* dst, uint32_t width, const RowLayout&) {
+  interleave_planes_sse41(planes[0], planes[1], planes[2], dst, width);
+}
+
+/*
+ * Planar kernel for formats that need converting. Each plane is converted in
+ * chunks to a small buffer on the stack, which stays in L1 while the chunk is
+ * interleaved.
+ */
+template<SpanConverter Span, PixelFormat Format>
+static void convert_planes_chunked(const uint8_t* const* planes, uint8_t* dst, uint32_t width, const RowLayout&) {
+  constexpr size_t sampleSize = sizeof(typename SampleTraits<Format>::type);
+  constexpr uint32_t chunkPixels = 256;
+  uint8_t chunk[3][chunkPixels];
+
+  for (uint32_t iPixel = 0; iPixel < width; iPixel += chunkPixels) {
+    uint32_t nPixels = std::min(chunkPixels, width - iPixel);
+    for (uint32_t iChannel = 0; iChannel < 3; iChannel++) {
+      Span(planes[iChannel] + size_t(iPixel) * sampleSize, chunk[iChannel], nPixels);
+    }
+    interleave_planes_sse41(chunk[0], chunk[1], chunk[2], dst + size_t(iPixel) * 3, nPixels);
+  }
+}
+
+/*
+ * Row kernel for packed pixels where every input channel is written, so the
+ * whole row is a single contiguous run of samples
+ */
+template<SpanConverter Span>
+static void convert_row_contiguous(const uint8_t* src, uint8_t* dst, uint32_t width, const RowLayout& layout) {
+  Span(src, dst, size_t(width) * layout.components);
+}
+
+/*
+ * Row kernel for four channel input written as three components. Samples are
+ * converted in chunks to a small buffer on the stack, then compacted. The last
+ * pixel is converted separately so we never read past its last used channel.
+ */
+template<SpanConverter Span, PixelFormat Format>
+static void convert_row_drop_fourth(const uint8_t* src, uint8_t* dst, uint32_t width, const RowLayout&) {
+  constexpr size_t sampleSize = sizeof(typename SampleTraits<Format>::type);
+  constexpr uint32_t chunkPixels = 64;
+  uint8_t chunk[chunkPixels * 4];
+
+  if (width == 0) return;
+  for (uint32_t iPixel = 0; iPixel < width - 1; iPixel += chunkPixels) {
+    uint32_t nPixels = std::min(chunkPixels, width - 1 - iPixel);
+    Span(src + size_t(iPixel) * 4 * sampleSize, chunk, size_t(nPixels) * 4);
+    drop_fourth_channel_sse41(chunk, dst + size_t(iPixel) * 3, nPixels);
+  }
+  convert_row_packed<Format, 4, 3>(src + size_t(width - 1) * 4 * sampleSize, dst + size_t(width - 1) * 3, 1, {});
+}
+
+template<SpanConverter Span, PixelFormat Format>
+static RowConverter select_simd_layout(const RowLayout& layout) {
+  if (layout.inChannels == layout.components) return convert_row_contiguous<Span>;
+  if (layout.inChannels == 4 && layout.components == 3) return convert_row_drop_fourth<Span, Format>;
+  return nullptr;
+}
+
+/*
+ * Picks the widest available SIMD kernel for a packed layout, or nullptr if
+ * there is none and the scalar kernels should be used
+ */
+static RowConverter select_simd_converter(PixelFormat format, const RowLayout& layout) {
+  const CpuFeatures& cpu = cpu_features();
+  if (!cpu.sse41) return nullptr;
+
+  switch (format) {
+    case PixelFormat::Uint16: {
+      if (cpu.avx512f && cpu.avx2) return select_simd_layout<convert_span_u16_avx512, PixelFormat::Uint16>(layout);
+      if (cpu.avx2) return select_simd_layout<convert_span_u16_avx2, PixelFormat::Uint16>(layout);
+      return select_simd_layout<convert_span_u16_sse41, PixelFormat::Uint16>(layout);
+    }
+    case PixelFormat::Float16: {
+      if (!cpu.f16c) return nullptr;
+      if (cpu.avx512f && cpu.avx2) return select_simd_layout<convert_span_f16_avx512, PixelFormat::Float16>(layout);
+      if (cpu.avx2) return select_simd_layout<convert_span_f16_avx2, PixelFormat::Float16>(layout);
+      return select_simd_layout<convert_span_f16_sse41, PixelFormat::Float16>(layout);
+    }
+    case PixelFormat::Float32: {
+      if (cpu.avx512f && cpu.avx2) return select_simd_layout<convert_span_f32_avx512, PixelFormat::Float32>(layout);
+      if (cpu.avx2) return select_simd_layout<convert_span_f32_avx2, PixelFormat::Float32>(layout);
+      return select_simd_layout<convert_span_f32_sse41, PixelFormat::Float32>(layout);
+    }
+    default: return nullptr;
+  }
+}
+
+/*
+ * Picks the widest available SIMD kernel for planar RGB input, or nullptr if
+ * the scalar kernels should be used
+ */
+static PlanarConverter select_simd_planar_converter(PixelFormat format) {
+  const CpuFeatures& cpu = cpu_features();
+  if (!cpu.sse41) return nullptr;
+
+  switch (format) {
+    case PixelFormat::Uint8: return convert_planes_u8_sse41;
+    case PixelFormat::Uint16: {
+      if (cpu.avx512f && cpu.avx2) return convert_planes_chunked<convert_span_u16_avx512, PixelFormat::Uint16>;
+      if (cpu.avx2) return convert_planes_chunked<convert_span_u16_avx2, PixelFormat::Uint16>;
+      return convert_planes_chunked<convert_span_u16_sse41, PixelFormat::Uint16>;
+    }
+    case PixelFormat::Float16: {
+      if (!cpu.f16c) return nullptr;
+      if (cpu.avx512f && cpu.avx2) return convert_planes_chunked<convert_span_f16_avx512, PixelFormat::Float16>;
+      if (cpu.avx2) return convert_planes_chunked<convert_span_f16_avx2, PixelFormat::Float16>;
+      return convert_planes_chunked<convert_span_f16_sse41, PixelFormat::Float16>;
+    }
+    case PixelFormat::Float32: {
+      if (cpu.avx512f && cpu.avx2) return convert_planes_chunked<convert_span_f32_avx512, PixelFormat::Float32>;
+      if (cpu.avx2) return convert_planes_chunked<convert_span_f32_avx2, PixelFormat::Float32>;
+      return convert_planes_chunked<convert_span_f32_sse41, PixelFormat::Float32>;
+    }
+    default: return nullptr;
+  }
+}
+
+#endif
+
+template<PixelFormat Format>
+static RowConverter select_format_converter(const RowLayout& layout) {
+  RowConverter converter = nullptr;
+
+  if (layout.pixelStride == layout.inChannels * layout.channelStride) {
+#ifdef SIMPLEJPEG_X86_SIMD
+    if (RowConverter simd = select_simd_converter(Format, layout)) return simd;
+#endif
+
+    switch (layout.components) {
+      case 1: converter = select_packed_converter<Format, 1>(layout.inChannels); break;
+      case 3: converter = select_packed_converter<Format, 3>(layout.inChannels); break;
+      default: break;
+    }
+  }
+
+  return converter ? converter : convert_row_strided<Format>;
+}
+
+/*
+ * Whether rows can be handed to libjpeg as they are: 8bpc samples, with each
+ * pixel holding exactly the components being written
+ */
+static bool is_zero_copy(PixelFormat format, const RowLayout& layout) {
+  return format == PixelFormat::Uint8 && layout.pixelStride == layout.components;
+}
+
+/*
+ * Kernel for rows that are already laid out the way libjpeg wants them, but
+ * can't be handed to it in place (tiled input)
+ */
+static void copy_row(const uint8_t* src, uint8_t* dst, uint32_t width, const RowLayout& layout) {
+  std::memcpy(dst, src, size_t(width) * layout.components);
+}
+
+template<LinearSpan Encode, PixelFormat Format, bool Matrix>
+static RowConverter select_linear_layout(const RowLayout& layout) {
+  const bool packed = layout.pixelStride == layout.inChannels * layout.channelStride;
+  if (layout.components == 1) {
+    return packed && layout.inChannels == 1
+           ? convert_row_linear<Format, 1, 1, false, Encode>
+           : convert_row_linear<Format, 0, 1, false, Encode>;
+  }
+
+  if (packed && layout.inChannels == 3) return convert_row_linear<Format, 3, 3, Matrix, Encode>;
+  if (packed && layout.inChannels == 4) return convert_row_linear<Format, 4, 3, Matrix, Encode>;
+  return convert_row_linear<Format, 0, 3, Matrix, Encode>;
+}
+
+template<LinearSpan Encode, PixelFormat Format>
+static RowConverter select_linear_format(const RowLayout& layout) {
+  return layout.gamutMatrix
+         ? select_linear_layout<Encode, Format, true>(layout)
+         : select_linear_layout<Encode, Format, false>(layout);
+}
+
+template<LinearSpan Encode, PixelFormat Format>
+static PlanarConverter select_linear_planar_format(const RowLayout& layout) {
+  return layout.gamutMatrix ? convert_planes_linear<Format, true, Encode> : convert_planes_linear<Format, false, Encode>;
+}
+
+/*
+ * Kernels for linear input, which is always in a floating point format
+ */
+template<LinearSpan Encode>
+static RowConverter select_linear_converter(PixelFormat format, const RowLayout& layout) {
+  switch (format) {
+    case PixelFormat::Float16: return select_linear_format<Encode, PixelFormat::Float16>(layout);
+    case PixelFormat::Float32: return select_linear_format<Encode, PixelFormat::Float32>(layout);
+    case PixelFormat::Float64: return select_linear_format<Encode, PixelFormat::Float64>(layout);
+    default: return nullptr;
+  }
+}
+
+template<LinearSpan Encode>
+static PlanarConverter select_linear_planar_converter(PixelFormat format, const RowLayout& layout) {
+  switch (format) {
+    case PixelFormat::Float16: return select_linear_planar_format<Encode, PixelFormat::Float16>(layout);
+    case PixelFormat::Float32: return select_linear_planar_format<Encode, PixelFormat::Float32>(layout);
+    case PixelFormat::Float64: return select_linear_planar_format<Encode, PixelFormat::Float64>(layout);
+    default: return nullptr;
+  }
+}
+
+static RowConverter select_row_converter(PixelFormat format, const RowLayout& layout) {
+  if (layout.linear) {
+#ifdef SIMPLEJPEG_X86_SIMD
+    if (cpu_features().avx2) return select_linear_converter<linear_to_srgb_span_avx2>(format, layout);
+#endif
+    return select_linear_converter<linear_to_srgb_scalar>(format, layout);
+  }
+
+  if (layout.toneCurve) {
+    return layout.components == 1 ? convert_row_tone_curve<1> : convert_row_tone_curve<3>;
+  }
+
+  if (is_zero_copy(format, layout)) return copy_row;
+
+  switch (format) {
+    case PixelFormat::Uint8: return select_format_converter<PixelFormat::Uint8>(layout);
+    case PixelFormat::Uint16: return select_format_converter<PixelFormat::Uint16>(layout);
+    case PixelFormat::Float16: return select_format_converter<PixelFormat::Float16>(layout);
+    case PixelFormat::Uint32: return select_format_converter<PixelFormat::Uint32>(layout);
+    case PixelFormat::Float32: return select_format_converter<PixelFormat::Float32>(layout);
+    case PixelFormat::Uint64: return select_format_converter<PixelFormat::Uint64>(layout);
+    case PixelFormat::Float64: return select_format_converter<PixelFormat::Float64>(layout);
+  }
+
+  return convert_row_strided<PixelFormat::Uint8>;
+}
+
+static PlanarConverter select_planar_converter(PixelFormat format, const RowLayout& layout) {
+  if (layout.linear) {
+#ifdef SIMPLEJPEG_X86_SIMD
+    if (cpu_features().avx2) return select_linear_planar_converter<linear_to_srgb_span_avx2>(format, layout);
+#endif
+    return select_linear_planar_converter<linear_to_srgb_scalar>(format, layout);
+  }
+
+  if (layout.toneCurve) return convert_planes_tone_curve;
+
+#ifdef SIMPLEJPEG_X86_SIMD
+  if (PlanarConverter simd = select_simd_planar_converter(format)) return simd;
+#endif
+
+  switch (format) {
+    case PixelFormat::Uint8: return convert_planes_scalar<PixelFormat::Uint8>;
+    case PixelFormat::Uint16: return convert_planes_scalar<PixelFormat::Uint16>;
+    case PixelFormat::Float16: return convert_planes_scalar<PixelFormat::Float16>;
+    case PixelFormat::Uint32: return convert_planes_scalar<PixelFormat::Uint32>;
+    case PixelFormat::Float32: return convert_planes_scalar<PixelFormat::Float32>;
+    case PixelFormat::Uint64: return convert_planes_scalar<PixelFormat::Uint64>;
+    case PixelFormat::Float64: return convert_planes_scalar<PixelFormat::Float64>;
+  }
+
+  return convert_planes_scalar<PixelFormat::Uint8>;
+}
+
+/*
+ * Output kernels for decoding, the reverse of the row kernels: they write a row
+ * of packed 8bpc samples from libjpeg to the output format and layout. src is
+ * the row from libjpeg, dst the first channel to write of the first pixel.
+ */
+template<PixelFormat Format, uint32_t Components>
+static void store_row(const uint8_t* src, uint8_t* dst, uint32_t width, const RowLayout& layout) {
+  using Sample = typename SampleTraits<Format>::type;
+
+  for (uint32_t iPixel = 0; iPixel < width; iPixel++) {
+    for (uint32_t iChannel = 0; iChannel < Components; iChannel++) {
+      const Sample v = SampleTraits<Format>::expand(src[iChannel]);
+      std::memcpy(dst + iChannel * sizeof(Sample), &v, sizeof(v));
+    }
+    src += Components;
+    dst += layout.pixelStride;
+  }
+}
+
+template<PixelFormat Format>
+static RowConverter select_store_format(uint32_t components) {
+  return components == 1 ? store_row<Format, 1> : store_row<Format, 3>;
+}
+
+static RowConverter select_store_row(PixelFormat format, const RowLayout& layout) {
+  switch (format) {
+    case PixelFormat::Uint8: return select_store_format<PixelFormat::Uint8>(layout.components);
+    case PixelFormat::Uint16: return select_store_format<PixelFormat::Uint16>(layout.components);
+    case PixelFormat::Float16: return select_store_format<PixelFormat::Float16>(layout.components);
+    case PixelFormat::Uint32: return select_store_format<PixelFormat::Uint32>(layout.components);
+    case PixelFormat::Float32: return select_store_format<PixelFormat::Float32>(layout.components);
+    case PixelFormat::Uint64: return select_store_format<PixelFormat::Uint64>(layout.components);
+    case PixelFormat::Float64: return select_store_format<PixelFormat::Float64>(layout.components);
+  }
+
+  return select_store_format<PixelFormat::Uint8>(layout.components);
+}
+
+/*
+ * Tone curves
+ */
+ToneCurve::ToneCurve(const std::function<float(float)>& curve) : m_table(65536) {
+  for (uint32_t i = 0; i < m_table.size(); i++) {
+    const float v = curve(float(i) / 65535.0f);
+    // Written this way round so NaN maps to 0
+    m_table[i] = v > 0 ? uint8_t(std::min(v, 1.0f) * 255.0f + 0.5f) : 0;
+  }
+}
+
+ToneCurve ToneCurve::gamma(float gamma) {
+  return ToneCurve([gamma](float v) { return std::pow(v, 1.0f / gamma); });
+}
+
+/*
+ * Writers
+ */
+FileDescriptorWriter::FileDescriptorWriter(int fd) noexcept: m_fd(fd) {}
+
+void FileDescriptorWriter::write(const uint8_t* data, size_t size) {
+  while (size > 0) {
+#ifdef _WIN32
+    auto written = _write(m_fd, data, unsigned(std::min<size_t>(size, 1u << 30)));
+#else
+    auto written = ::write(m_fd, data, size);
+#endif
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      throw std::system_error(errno, std::generic_category(), "write");
+    }
+
+    data += written;
+    size -= size_t(written);
+  }
+}
+
+FileWriter::FileWriter(FILE* file) noexcept: m_file(file), m_owned(false) {}
+
+FileWriter::FileWriter(const fs::path& path): m_file(nullptr), m_owned(true) {
+#ifdef _WIN32
+  m_file = _wfopen(path.c_str(), L"wb");
+#else
+  m_file = std::fopen(path.c_str(), "wb");
+#endif
+  if (!m_file) throw std::system_error(errno, std::generic_category(), path.string());
+}
+
+FileWriter::~FileWriter() {
+  if (m_owned && m_file) std::fclose(m_file);
+}
+
+void FileWriter::write(const uint8_t* data, size_t size) {
+  if (std::fwrite(data, 1, size, m_file) != size) {
+    throw std::system_error(errno, std::generic_category(), "fwrite");
+  }
+}
+
+void FileWriter::flush() {
+  if (std::fflush(m_file) != 0) {
+    throw std::system_error(errno, std::generic_category(), "fflush");
+  }
+}
+
+void MemoryWriter::write(const uint8_t* data, size_t size) {
+  m_buffer.insert(m_buffer.end(), data, data + size);
+}
+
+CallbackWriter::CallbackWriter(Callback callback) noexcept: m_callback(std::move(callback)) {}
+
+void CallbackWriter::write(const uint8_t* data, size_t size) {
+  m_callback(data, size);
+}
+
+AsyncWriter::AsyncWriter(Writer& writer, size_t bufferCount, size_t bufferSize) : m_writer(writer) {
+  bufferCount = std::max<size_t>(bufferCount, 1);
+  m_buffers.resize(bufferCount, std::vector<uint8_t>(std::max<size_t>(bufferSize, 1)));
+  for (size_t i = bufferCount - 1; i > 0; i--) m_free.push_back(i);
+
+  m_thread = std::thread(&AsyncWriter::run, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+  {
+    std::lock_guard lock(m_mutex);
+    if (m_used > 0) m_queue.push_back({m_current, m_used, false, std::nullopt});
+    m_stopping = true;
+  }
+  m_wake.notify_one();
+
+  m_thread.join();
+}
+
+void AsyncWriter::write(const uint8_t* data, size_t size) {
+  while (size > 0) {
+    std::vector<uint8_t>& buffer = m_buffers[m_current];
+    const size_t chunk = std::min(size, buffer.size() - m_used);
+    std::memcpy(buffer.data() + m_used, data, chunk);
+    m_used += chunk;
+    data += chunk;
+    size -= chunk;
+
+    if (m_used == buffer.size()) submit(false, std::nullopt);
+  }
+}
+
+void AsyncWriter::flush() {
+  submit(true, std::nullopt);
+}
+
+std::future<void> AsyncWriter::sync() {
+  std::promise<void> done;
+  std::future<void> future = done.get_future();
+  submit(true, std::move(done));
+  return future;
+}
+
+/*
+ * Queues the current buffer and takes the next free one, waiting for the I/O
+ * thread to release one if needed
+ */
+void AsyncWriter::submit(bool flush, std::optional<std::promise<void>> done) {
+  std::unique_lock lock(m_mutex);
+  if (m_error) {
+    if (!done) std::rethrow_exception(m_error);
+    done->set_exception(m_error);
+    return;
+  }
+
+  m_queue.push_back({m_current, m_used, flush, std::move(done)});
+  m_wake.notify_one();
+
+  m_released.wait(lock, [this] { return !m_free.empty(); });
+  m_current = m_free.back();
+  m_free.pop_back();
+  m_used = 0;
+}
+
+void AsyncWriter::run() {
+  while (true) {
+    Block block;
+    std::exception_ptr error;
+    {
+      std::unique_lock lock(m_mutex);
+      m_wake.wait(lock, [this] { return !m_queue.empty() || m_stopping; });
+      if (m_queue.empty()) return;
+
+      block = std::move(m_queue.front());
+      m_queue.pop_front();
+      error = m_error;
+    }
+
+    // Blocks queued after an error are dropped
+    if (!error) {
+      try {
+        if (block.size > 0) m_writer.write(m_buffers[block.buffer].data(), block.size);
+        if (block.flush) m_writer.flush();
+      } catch (...) {
+        error = std::current_exception();
+      }
+    }
+
+    {
+      std::lock_guard lock(m_mutex);
+      if (!m_error) m_error = error;
+      m_free.push_back(block.buffer);
+    }
+    m_released.notify_one();
+
+    if (block.done) {
+      if (error) block.done->set_exception(error);
+      else block.done->set_value();
+    }
+  }
+}
+
+/*
+ * Appends to a caller-owned vector, used for encoding to memory
+ */
+class VectorWriter : public Writer {
+public:
+  explicit VectorWriter(std::vector<uint8_t>& buffer) noexcept: m_buffer(buffer) {}
+
+  void write(const uint8_t* data, size_t size) override {
+    m_buffer.insert(m_buffer.end(), data, data + size);
+  }
+
+private:
+  std::vector<uint8_t>& m_buffer;
+};
+
+/*
+ * Input files
+ */
+
+/*
+ * Opens a file for reading, closing it when done
+ */
+static std::unique_ptr<FILE, int (*)(FILE*)> open_input(const fs::path& path) {
+#ifdef _WIN32
+  FILE* file = _wfopen(path.c_str(), L"rb");
+#else
+  FILE* file = std::fopen(path.c_str(), "rb");
+#endif
+  if (!file) throw std::system_error(errno, std::generic_category(), path.string());
+  return {file, std::fclose};
+}
+
+static void seek_input(FILE* file, uint64_t offset, int origin = SEEK_SET) {
+#ifdef _WIN32
+  const int result = _fseeki64(file, int64_t(offset), origin);
+#else
+  const int result = fseeko(file, off_t(offset), origin);
+#endif
+  if (result != 0) throw std::system_error(errno, std::generic_category(), "fseek");
+}
+
+static uint64_t input_size(FILE* file) {
+  seek_input(file, 0, SEEK_END);
+#ifdef _WIN32
+  const int64_t size = _ftelli64(file);
+#else
+  const int64_t size = ftello(file);
+#endif
+  if (size < 0) throw std::system_error(errno, std::generic_category(), "ftell");
+  return uint64_t(size);
+}
+
+/*
+ * Read-only mapping of a byte range of a file, read front to back
+ * Mapping isn't supported on Windows and can fail for files on some file
+ * systems or ranges too large for the address space, leaving the mapping empty.
+ */
+class MappedInput {
+public:
+  MappedInput(FILE* file, uint64_t begin, uint64_t end) {
+#ifndef _WIN32
+    m_pageSize = uint64_t(sysconf(_SC_PAGESIZE));
+    m_offset = begin - begin % m_pageSize;
+    m_released = m_offset;
+    if (end - m_offset > SIZE_MAX) return;
+
+    m_size = size_t(end - m_offset);
+    void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fileno(file), off_t(m_offset));
+    if (data == MAP_FAILED) return;
+
+    m_data = static_cast<const uint8_t*>(data);
+    madvise(const_cast<uint8_t*>(m_data), m_size, MADV_SEQUENTIAL);
+#else
+    (void) file;
+    (void) begin;
+    (void) end;
+#endif
+  }
+
+  ~MappedInput() {
+#ifndef _WIN32
+    if (m_data) munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+  }
+
+  MappedInput(const MappedInput&) = delete;
+  MappedInput& operator=(const MappedInput&) = delete;
+
+  explicit operator bool() const noexcept { return m_data; }
+
+  // Data at an offset into the file
+  [[nodiscard]] const uint8_t* at(uint64_t offset) const noexcept { return m_data + (offset - m_offset); }
+
+  /*
+   * Drops the pages before offset from the resident set. They're only read
+   * again from the page cache if touched again.
+   */
+  void release(uint64_t offset) noexcept {
+#ifndef _WIN32
+    const uint64_t end = offset - offset % m_pageSize;
+    if (end <= m_released) return;
+
+    madvise(const_cast<uint8_t*>(at(m_released)), size_t(end - m_released), MADV_DONTNEED);
+    m_released = end;
+#else
+    (void) offset;
+#endif
+  }
+
+private:
+  const uint8_t* m_data = nullptr;
+  size_t m_size = 0;
+  uint64_t m_offset = 0;
+  uint64_t m_pageSize = 0;
+  uint64_t m_released = 0;
+};
+
+/*
+ * Working memory of an encoder
+ * Holds libjpeg's image pool, which it would otherwise malloc and free for
+ * every image, along with the pipeline's buffers. Allocations bump a pointer
+ * through a block and are all released at once when the image is done. An
+ * image that outgrows the block gets overflow blocks, and the next image
+ * starts with a single block covering them all, so once an encoder has seen
+ * its largest image, encoding doesn't touch the heap.
+ */
+struct Encoder::Arena {
+  static constexpr size_t minBlockSize = 256 * 1024;
+  // libjpeg-turbo aligns its buffers for SIMD, this covers AVX-512
+  static constexpr size_t alignment = 64;
+
+  struct FreeBlock {
+    void operator()(uint8_t* data) const noexcept { ::operator delete[](data, std::align_val_t(alignment)); }
+  };
+
+  struct Block {
+    std::unique_ptr<uint8_t[], FreeBlock> data;
+    size_t size;
+  };
+
+  /*
+   * Virtual array in the image pool
+   * libjpeg can page these out to temporary files, but like its default
+   * backend, the arena keeps them in memory, so an array is a full set of rows.
+   */
+  struct VirtualArray {
+    bool isBlocks;
+    bool preZero;
+    JDIMENSION width;
+    JDIMENSION height;
+    // Rows of the requested type, once the array is realized
+    JSAMPARRAY samples;
+    JBLOCKARRAY blocks;
+    VirtualArray* next;
+  };
+
+  std::vector<Block> blocks;
+  size_t capacity = 0;
+  // Block being allocated from, and offset of its free space
+  size_t current = 0;
+  size_t offset = 0;
+
+  // Bytes handed out for the current image, and for the last one finished
+  size_t used = 0;
+  size_t lastUsed = 0;
+  size_t highWater = 0;
+  size_t limit = SIZE_MAX;
+  // Blocks allocated over the arena's lifetime
+  uint32_t allocations = 0;
+
+  // Requested for the current image, realized or not
+  VirtualArray* virtualArrays = nullptr;
+
+  // libjpeg's own memory manager, which keeps handling the permanent pool
+  jpeg_memory_mgr base{};
+
+  /*
+   * Routes the image pool of a compression object to the arena
+   */
+  void install(j_compress_ptr cinfo) noexcept {
+    base = *cinfo->mem;
+    cinfo->client_data = this;
+
+    jpeg_memory_mgr& mem = *cinfo->mem;
+    mem.alloc_small = alloc_small;
+    mem.alloc_large = alloc_large;
+    mem.alloc_sarray = alloc_sarray;
+    mem.alloc_barray = alloc_barray;
+    mem.request_virt_sarray = request_virt_sarray;
+    mem.request_virt_barray = request_virt_barray;
+    mem.realize_virt_arrays = realize_virt_arrays;
+    mem.access_virt_sarray = access_virt_sarray;
+    mem.access_virt_barray = access_virt_barray;
+    mem.free_pool = free_pool;
+  }
+
+  void* allocate(size_t size) {
+    size = (size + alignment - 1) / alignment * alignment;
+
+    // Start each image with a single block, holding everything the last one needed
+    if (used == 0 && (blocks.size() > 1 || capacity > limit)) {
+      const size_t total = std::min(capacity, limit);
+      blocks.clear();
+      capacity = 0;
+      if (total > 0) addBlock(total);
+    }
+
+    while (current < blocks.size() && blocks[current].size - offset < size) {
+      current++;
+      offset = 0;
+    }
+    if (current == blocks.size()) {
+      if (capacity > limit || size > limit - capacity) throw Error("Encoder memory limit exceeded");
+      addBlock(std::min(std::max({size, capacity, minBlockSize}), limit - capacity));
+    }
+
+    uint8_t* data = blocks[current].data.get() + offset;
+    offset += size;
+    used += size;
+    highWater = std::max(highWater, used);
+    return data;
+  }
+
+  template<typename T>
+  T* allocate(size_t count) {
+    return static_cast<T*>(allocate(sizeof(T) * count));
+  }
+
+  void addBlock(size_t size) {
+    std::unique_ptr<uint8_t[], FreeBlock> data(
+      static_cast<uint8_t*>(::operator new[](size, std::align_val_t(alignment)))
+    );
+    blocks.push_back({std::move(data), size});
+    capacity += size;
+    allocations++;
+  }
+
+  // Releases everything allocated for the image, keeping the blocks
+  void reset() noexcept {
+    if (used > 0) lastUsed = used;
+    used = 0;
+    current = 0;
+    offset = 0;
+    virtualArrays = nullptr;
+  }
+
+  /*
+   * Rows of elements, with each row padded to the alignment the same way
+   * libjpeg does
+   */
+  template<typename Row>
+  Row* allocateRows(JDIMENSION width, JDIMENSION height, size_t elementSize, bool zero = false) {
+    const size_t rowBytes = (width * elementSize + alignment - 1) / alignment * alignment;
+    Row* rows = allocate<Row>(height);
+    uint8_t* data = allocate<uint8_t>(rowBytes * height);
+    if (zero) std::memset(data, 0, rowBytes * height);
+
+    for (JDIMENSION iRow = 0; iRow < height; iRow++) rows[iRow] = reinterpret_cast<Row>(data + rowBytes * iRow);
+    return rows;
+  }
+
+  VirtualArray* requestVirtual(bool isBlocks, bool preZero, JDIMENSION width, JDIMENSION height) {
+    VirtualArray* array = allocate<VirtualArray>(1);
+    *array = {
+      .isBlocks = isBlocks,
+      .preZero = preZero,
+      .width = width,
+      .height = height,
+      .samples = nullptr,
+      .blocks = nullptr,
+      .next = virtualArrays,
+    };
+    virtualArrays = array;
+    return array;
+  }
+
+  VirtualArray* find(const void* ptr) const noexcept {
+    for (VirtualArray* array = virtualArrays; array; array = array->next) {
+      if (array == ptr) return array;
+    }
+    return nullptr;
+  }
+
+  /*
+   * Memory manager methods
+   */
+
+  static Arena& from(j_common_ptr cinfo) {
+    return *static_cast<Arena*>(cinfo->client_data);
+  }
+
+  // libjpeg-turbo 3 keeps 12-bit samples in the same arrays
+  static size_t sample_size(j_common_ptr cinfo) {
+    return reinterpret_cast<j_compress_ptr>(cinfo)->data_precision > 8 ? 2 : sizeof(JSAMPLE);
+  }
+
+  static void* alloc_small(j_common_ptr cinfo, int pool, size_t size) {
+    Arena& arena = from(cinfo);
+    return pool == JPOOL_IMAGE ? arena.allocate(size) : arena.base.alloc_small(cinfo, pool, size);
+  }
+
+  static void* alloc_large(j_common_ptr cinfo, int pool, size_t size) {
+    Arena& arena = from(cinfo);
+    return pool == JPOOL_IMAGE ? arena.allocate(size) : arena.base.alloc_large(cinfo, pool, size);
+  }
+
+  static JSAMPARRAY alloc_sarray(j_common_ptr cinfo, int pool, JDIMENSION width, JDIMENSION height) {
+    Arena& arena = from(cinfo);
+    if (pool != JPOOL_IMAGE) return arena.base.alloc_sarray(cinfo, pool, width, height);
+    return arena.allocateRows<JSAMPROW>(width, height, sample_size(cinfo));
+  }
+
+  static JBLOCKARRAY alloc_barray(j_common_ptr cinfo, int pool, JDIMENSION width, JDIMENSION height) {
+    Arena& arena = from(cinfo);
+    if (pool != JPOOL_IMAGE) return arena.base.alloc_barray(cinfo, pool, width, height);
+    return arena.allocateRows<JBLOCKROW>(width, height, sizeof(JBLOCK));
+  }
+
+  static jvirt_sarray_ptr request_virt_sarray(
+    j_common_ptr cinfo, int pool, boolean preZero, JDIMENSION width, JDIMENSION height, JDIMENSION maxAccess
+  ) {
+    Arena& arena = from(cinfo);
+    if (pool != JPOOL_IMAGE) return arena.base.request_virt_sarray(cinfo, pool, preZero, width, height, maxAccess);
+    return reinterpret_cast<jvirt_sarray_ptr>(arena.requestVirtual(false, preZero, width, height));
+  }
+
+  static jvirt_barray_ptr request_virt_barray(
+    j_common_ptr cinfo, int pool, boolean preZero, JDIMENSION width, JDIMENSION height, JDIMENSION maxAccess
+  ) {
+    Arena& arena = from(cinfo);
+    if (pool != JPOOL_IMAGE) return arena.base.request_virt_barray(cinfo, pool, preZero, width, height, maxAccess);
+    return reinterpret_cast<jvirt_barray_ptr>(arena.requestVirtual(true, preZero, width, height));
+  }
+
+  static void realize_virt_arrays(j_common_ptr cinfo) {
+    Arena& arena = from(cinfo);
+    arena.base.realize_virt_arrays(cinfo);
+
+    for (VirtualArray* array = arena.virtualArrays; array; array = array->next) {
+      if (array->samples || array->blocks) continue;
+
+      if (array->isBlocks) {
+        array->blocks = arena.allocateRows<JBLOCKROW>(array->width, array->height, sizeof(JBLOCK), array->preZero);
+      } else {
+        array->samples = arena.allocateRows<JSAMPROW>(
+          array->width, array->height, sample_size(cinfo), array->preZero
+        );
+      }
+    }
+  }
+
+  static JSAMPARRAY access_virt_sarray(
+    j_common_ptr cinfo, jvirt_sarray_ptr ptr, JDIMENSION startRow, JDIMENSION nRows, boolean writable
+  ) {
+    Arena& arena = from(cinfo);
+    // Arrays that aren't the arena's, like the source of a transform, belong to libjpeg
+    VirtualArray* array = arena.find(ptr);
+    if (!array) return arena.base.access_virt_sarray(cinfo, ptr, startRow, nRows, writable);
+
+    if (!array->samples) ERREXIT(cinfo, JERR_VIRTUAL_BUG);
+    if (startRow + nRows > array->height) ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+    return array->samples + startRow;
+  }
+
+  static JBLOCKARRAY access_virt_barray(
+    j_common_ptr cinfo, jvirt_barray_ptr ptr, JDIMENSION startRow, JDIMENSION nRows, boolean writable
+  ) {
+    Arena& arena = from(cinfo);
+    VirtualArray* array = arena.find(ptr);
+    if (!array) return arena.base.access_virt_barray(cinfo, ptr, startRow, nRows, writable);
+
+    if (!array->blocks) ERREXIT(cinfo, JERR_VIRTUAL_BUG);
+    if (startRow + nRows > array->height) ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+    return array->blocks + startRow;
+  }
+
+  static void free_pool(j_common_ptr cinfo, int pool) {
+    Arena& arena = from(cinfo);
+    arena.base.free_pool(cinfo, pool);
+    if (pool == JPOOL_IMAGE) arena.reset();
+  }
+};
+
+/*
+ * libjpeg destination manager backed by a writer
+ * Compressed data is collected in a fixed-size buffer and handed to the writer
+ * each time it fills up, so output streams out while compression runs.
+ */
+struct Encoder::Destination : jpeg_destination_mgr {
+  static constexpr size_t bufferSize = 64 * 1024;
+
+  Writer* writer = nullptr;
+  std::vector<uint8_t> buffer = std::vector<uint8_t>(bufferSize);
+
+  // Encoder reporting write times, and bytes written for the current image
+  Encoder* encoder = nullptr;
+  uint64_t bytesWritten = 0;
+
+  Destination() : jpeg_destination_mgr() {
+    init_destination = init;
+    empty_output_buffer = empty;
+    term_destination = term;
+  }
+
+  static Destination& from(j_compress_ptr cinfo) {
+    return *static_cast<Destination*>(cinfo->dest);
+  }
+
+  static void init(j_compress_ptr cinfo) {
+    Destination& dest = from(cinfo);
+    dest.next_output_byte = dest.buffer.data();
+    dest.free_in_buffer = dest.buffer.size();
+  }
+
+  void output(size_t size, bool flush) {
+    const bool timed = encoder->timed();
+    const auto start = timed ? Clock::now() : Clock::time_point();
+
+    writer->write(buffer.data(), size);
+    if (flush) writer->flush();
+    bytesWritten += size;
+
+    if (timed) encoder->record(EncodePhase::Output, start, 0, size);
+  }
+
+  static boolean empty(j_compress_ptr cinfo) {
+    Destination& dest = from(cinfo);
+    dest.output(dest.buffer.size(), false);
+    dest.next_output_byte = dest.buffer.data();
+    dest.free_in_buffer = dest.buffer.size();
+    return TRUE;
+  }
+
+  static void term(j_compress_ptr cinfo) {
+    Destination& dest = from(cinfo);
+    dest.output(dest.buffer.size() - dest.free_in_buffer, true);
+  }
+
+  /*
+   * Copies serialized marker segments straight to the output
+   * Only valid between starting compression and the first scanline, where
+   * libjpeg's own marker writer emits bytes the same way.
+   */
+  void append(j_compress_ptr cinfo, const uint8_t* data, size_t size) {
+    while (size > 0) {
+      if (free_in_buffer == 0) empty(cinfo);
+
+      const size_t chunk = std::min(size, free_in_buffer);
+      std::memcpy(next_output_byte, data, chunk);
+      next_output_byte += chunk;
+      free_in_buffer -= chunk;
+      data += chunk;
+      size -= chunk;
+    }
+  }
+};
+
+/*
+ * Settings that determine how the compression object is configured
+ * libjpeg keeps its parameters between images, so when the next image uses
+ * the same settings, setup skips straight to starting compression. Shared
+ * Huffman tables are compared by address, so they're copied in regardless.
+ */
+struct CompressionSettings {
+  ColorMode colorMode;
+  Compression compression;
+  uint32_t restartInterval;
+
+  bool operator==(const CompressionSettings& other) const = default;
+};
+
+/*
+ * Per-image state of the conversion pipeline
+ * Buffers are allocated from the encoder's arena for each image.
+ */
+struct Encoder::Pipeline {
+  bool active = false;
+
+  RowLayout layout{};
+  RowConverter convertRow = nullptr;
+  bool zeroCopy = false;
+
+  uint32_t width = 0;
+  size_t rowStride = 0;
+  // Pixel and channel offsets, in bytes from the start of each row
+  size_t rowOffset = 0;
+  size_t rowBytes = 0;
+
+  uint32_t stripHeight = 0;
+  uint8_t* stripBuffer = nullptr;
+  JSAMPROW* stripRows = nullptr;
+  uint32_t rowsWritten = 0;
+
+  /*
+   * Planar input
+   * Planar RGB is converted and interleaved into the strip buffer. Planar
+   * YCbCr is written with jpeg_write_raw_data (raw); libjpeg reads whole
+   * blocks, so rows whose width isn't a multiple of the block size are copied
+   * to a buffer with the last pixel repeated.
+   */
+  struct PlaneState {
+    // First row, with offsets applied
+    const uint8_t* data = nullptr;
+    size_t rowStride = 0;
+    // The rest is only used for raw input
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t paddedWidth = 0;
+    // Rows of this plane in one strip
+    uint32_t stripHeight = 0;
+    // Only set when rows need padding
+    uint8_t* buffer = nullptr;
+    JSAMPROW* rows = nullptr;
+  };
+
+  bool planar = false;
+  bool raw = false;
+  PlanarConverter convertPlanes = nullptr;
+  std::array<PlaneState, 3> planes;
+
+  /*
+   * Tiled input
+   * Strips are converted a tile at a time. rowStride is the row stride within a
+   * tile, and rowOffset only holds the channel offset.
+   */
+  struct TileState {
+    // Tile size in pixels (width 0 = not tiled)
+    uint32_t width = 0;
+    uint32_t height = 0;
+    // Distance between horizontally and vertically adjacent tiles, in bytes
+    size_t columnStride = 0;
+    size_t rowStride = 0;
+    // Position of the first pixel in the tile grid
+    uint32_t originX = 0;
+    uint32_t originY = 0;
+  };
+
+  TileState tiles;
+
+  /*
+   * Rate control for Compression::targetBytes
+   * The image is compressed at quality 100, where every quantizer is 1, in
+   * progressive mode so libjpeg keeps the coefficients of the whole image and
+   * its first pass only gathers statistics for the DC scan. Finishing copies
+   * the coefficients out, then each trial quantizes and entropy codes them.
+   */
+  struct TargetState {
+    // Largest output size (0 = no target)
+    size_t bytes = 0;
+    // Settings of the trials, with the highest quality to try
+    CompressionSettings settings{};
+    std::optional<ColorSpace> profile;
+    Writer* writer = nullptr;
+    // Coefficients of each component in turn, and their size in blocks
+    std::vector<JCOEF> coefficients;
+    std::array<std::pair<JDIMENSION, JDIMENSION>, MAX_COMPONENTS> blocks{};
+    // Output of the best fitting trial and of the current one
+    std::array<MemoryWriter, 2> outputs;
+  };
+
+  TargetState target;
+
+  // Settings the compression object was last configured with
+  std::optional<CompressionSettings> settings;
+
+  // Instrumentation, only timed when stats or a trace callback are requested
+  EncodeStats* stats = nullptr;
+  bool timed = false;
+  Clock::time_point beginTime;
+  // Arena blocks allocated before the image started
+  uint32_t arenaAllocations = 0;
+  // Output time within the phase currently being timed
+  std::chrono::nanoseconds nestedOutputTime{};
+};
+
+/*
+ * Luma sampling factors for a chroma subsampling mode
+ */
+static std::pair<int, int> luma_sampling(ChromaSubsampling subsampling) {
+  switch (subsampling) {
+    case ChromaSubsampling::Chroma444: return {1, 1};
+    case ChromaSubsampling::Chroma422: return {2, 1};
+    case ChromaSubsampling::Chroma420: return {2, 2};
+  }
+
+  return {2, 2};
+}
+
+static bool is_ycbcr(ColorMode mode) {
+  return mode == ColorMode::YCbCr444 || mode == ColorMode::YCbCr422 || mode == ColorMode::YCbCr420;
+}
+
+/*
+ * Luma sampling factors of an image, given by the color mode for planar input
+ * and by the compression settings for RGB
+ */
+static std::pair<int, int> luma_sampling(ColorMode colorMode, ChromaSubsampling subsampling) {
+  switch (colorMode) {
+    case ColorMode::RGB: return luma_sampling(subsampling);
+    case ColorMode::Grayscale: return {1, 1};
+    case ColorMode::YCbCr444: return luma_sampling(ChromaSubsampling::Chroma444);
+    case ColorMode::YCbCr422: return luma_sampling(ChromaSubsampling::Chroma422);
+    case ColorMode::YCbCr420: return luma_sampling(ChromaSubsampling::Chroma420);
+  }
+
+  return {1, 1};
+}
+
+static std::pair<int, int> luma_sampling(const EncodeParams& params) {
+  return luma_sampling(params.colorMode, params.compression.subsampling);
+}
+
+/*
+ * Replaces libjpeg's default error handler, which would exit the process
+ */
+static void error_exit(j_common_ptr cinfo) {
+  char message[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, message);
+  throw Error(message);
+}
+
+/*
+ * libjpeg's standard Huffman tables (luma DC, chroma DC, luma AC, chroma AC)
+ * Encodes with optimized tables overwrite the tables in the compression object,
+ * and jpeg_set_defaults only installs the standard ones where none exist yet,
+ * so they're restored from this copy before every image.
+ */
+static const std::array<JHUFF_TBL, 4>& standard_huffman_tables() {
+  static const std::array<JHUFF_TBL, 4> tables = [] {
+    jpeg_compress_struct cinfo{};
+    jpeg_error_mgr jerr{};
+    cinfo.err = jpeg_std_error(&jerr);
+    jerr.error_exit = error_exit;
+    jpeg_create_compress(&cinfo);
+
+    cinfo.in_color_space = JCS_RGB;
+    cinfo.input_components = 3;
+    jpeg_set_defaults(&cinfo);
+    std::array<JHUFF_TBL, 4> std = {
+      *cinfo.dc_huff_tbl_ptrs[0], *cinfo.dc_huff_tbl_ptrs[1],
+      *cinfo.ac_huff_tbl_ptrs[0], *cinfo.ac_huff_tbl_ptrs[1],
+    };
+
+    jpeg_destroy_compress(&cinfo);
+    return std;
+  }();
+  return tables;
+}
+
+static void set_huffman_tables(j_compress_ptr cinfo, const std::array<JHUFF_TBL, 4>& tables) {
+  *cinfo->dc_huff_tbl_ptrs[0] = tables[0];
+  *cinfo->dc_huff_tbl_ptrs[1] = tables[1];
+  *cinfo->ac_huff_tbl_ptrs[0] = tables[2];
+  *cinfo->ac_huff_tbl_ptrs[1] = tables[3];
+}
+
+static void reset_huffman_tables(j_compress_ptr cinfo) {
+  set_huffman_tables(cinfo, standard_huffman_tables());
+}
+
+/*
+ * Builds a Huffman table with optimal code lengths for the given symbol
+ * frequencies (JPEG Annex K.2). Entry 256 is reserved for a pseudo-symbol,
+ * which keeps any code from being all ones.
+ */
+static void generate_huffman_table(JHUFF_TBL& table, std::array<long, 257> freq) {
+  static constexpr int maxCodeLength = 32;
+  std::array<int, 257> codeSize{};
+  std::array<int, 257> others;
+  others.fill(-1);
+  freq[256] = 1;
+
+  // Repeatedly merge the two least frequent trees, tracking each symbol's depth
+  while (true) {
+    int c1 = -1, c2 = -1;
+    long v1 = 1000000000L, v2 = 1000000000L;
+    for (int i = 0; i <= 256; i++) {
+      if (freq[i] && freq[i] <= v1) {
+        v2 = v1;
+        c2 = c1;
+        v1 = freq[i];
+        c1 = i;
+      } else if (freq[i] && freq[i] <= v2) {
+        v2 = freq[i];
+        c2 = i;
+      }
+    }
+    if (c2 < 0) break;
+
+    freq[c1] += freq[c2];
+    freq[c2] = 0;
+
+    codeSize[c1]++;
+    while (others[c1] >= 0) {
+      c1 = others[c1];
+      codeSize[c1]++;
+    }
+    others[c1] = c2;
+
+    codeSize[c2]++;
+    while (others[c2] >= 0) {
+      c2 = others[c2];
+      codeSize[c2]++;
+    }
+  }
+
+  std::array<int, maxCodeLength + 1> bits{};
+  for (int i = 0; i <= 256; i++) {
+    if (codeSize[i]) bits[codeSize[i]]++;
+  }
+
+  // Limit codes to 16 bits, moving pairs of long codes up the tree
+  for (int i = maxCodeLength; i > 16; i--) {
+    while (bits[i] > 0) {
+      int j = i - 2;
+      while (bits[j] == 0) j--;
+
+      bits[i] -= 2;
+      bits[i - 1]++;
+      bits[j + 1] += 2;
+      bits[j]--;
+    }
+  }
+
+  // Drop the pseudo-symbol, which has the longest code
+  int longest = 16;
+  while (bits[longest] == 0) longest--;
+  bits[longest]--;
+
+  table = {};
+  for (int i = 1; i <= 16; i++) table.bits[i] = UINT8(bits[i]);
+
+  int iSymbol = 0;
+  for (int length = 1; length <= maxCodeLength; length++) {
+    for (int symbol = 0; symbol < 256; symbol++) {
+      if (codeSize[symbol] == length) table.huffval[iSymbol++] = UINT8(symbol);
+    }
+  }
+}
+
+/*
+ * Rebuilds a Huffman table so every symbol of an 8-bit sequential scan has a
+ * code: DC categories 0 to 11, AC run/size pairs with sizes 1 to 10, EOB and
+ * ZRL. Symbols already in the table keep about the same code lengths, missing
+ * ones get the longest codes.
+ */
+static void complete_huffman_table(JHUFF_TBL& table, bool ac) {
+  std::array<long, 257> freq{};
+
+  int iSymbol = 0;
+  for (int length = 1; length <= 16; length++) {
+    for (int i = 0; i < table.bits[length]; i++) freq[table.huffval[iSymbol++]] = 1L << (17 - length);
+  }
+
+  for (int symbol = 0; symbol < 256; symbol++) {
+    const int size = symbol & 0xF;
+    const bool valid = ac ? (size >= 1 && size <= 10) || symbol == 0x00 || symbol == 0xF0 : symbol <= 11;
+    if (valid && !freq[symbol]) freq[symbol] = 1;
+  }
+
+  generate_huffman_table(table, freq);
+}
+
+/*
+ * ICC profile serialized as APP2 marker segments, the way jpeg_write_icc_profile
+ * writes it, so it can be copied to the output in one go
+ */
+static std::vector<uint8_t> icc_segments(const uint8_t* profile, size_t size) {
+  static constexpr uint8_t identifier[12] = {'I', 'C', 'C', '_', 'P', 'R', 'O', 'F', 'I', 'L', 'E', 0};
+  // Length field, identifier, sequence number and chunk count
+  static constexpr size_t overhead = 2 + sizeof(identifier) + 2;
+  static constexpr size_t maxChunk = 65535 - overhead;
+
+  const size_t nChunks = (size + maxChunk - 1) / maxChunk;
+  std::vector<uint8_t> segments;
+  segments.reserve(size + nChunks * (overhead + 2));
+
+  for (size_t iChunk = 0; iChunk < nChunks; iChunk++) {
+    const uint8_t* chunk = profile + iChunk * maxChunk;
+    const size_t chunkSize = std::min(maxChunk, size - iChunk * maxChunk);
+    const size_t length = chunkSize + overhead;
+
+    segments.insert(segments.end(), {0xFF, JPEG_APP0 + 2, uint8_t(length >> 8), uint8_t(length)});
+    segments.insert(segments.end(), std::begin(identifier), std::end(identifier));
+    segments.insert(segments.end(), {uint8_t(iChunk + 1), uint8_t(nChunks)});
+    segments.insert(segments.end(), chunk, chunk + chunkSize);
+  }
+
+  return segments;
+}
+
+static const std::vector<uint8_t>& icc_profile_segments(ColorSpace colorSpace) {
+  static const std::vector<uint8_t> sRGB = icc_segments(icc_data::sRGB2014_icc, icc_data::sRGB2014_icc_len);
+  static const std::vector<uint8_t> displayP3 = icc_segments(
+    icc_data::Display_P3_icc, icc_data::Display_P3_icc_len
+  );
+
+  return colorSpace == ColorSpace::DisplayP3 ? displayP3 : sRGB;
+}
+
+/*
+ * Configures the compression object for a combination of settings
+ * Everything set here is kept by libjpeg between images.
+ */
+static void configure(
+  j_compress_ptr cinfo, const CompressionSettings& settings, const std::array<JHUFF_TBL, 4>& huffmanTables
+) {
+  switch (settings.colorMode) {
+    case ColorMode::RGB: {
+      cinfo->input_components = 3;
+      cinfo->in_color_space = JCS_RGB;
+      break;
+    }
+    case ColorMode::Grayscale: {
+      cinfo->input_components = 1;
+      cinfo->in_color_space = JCS_GRAYSCALE;
+      break;
+    }
+    case ColorMode::YCbCr444:
+    case ColorMode::YCbCr422:
+    case ColorMode::YCbCr420: {
+      cinfo->input_components = 3;
+      cinfo->in_color_space = JCS_YCbCr;
+      break;
+    }
+  }
+
+  /*
+   * Set default settings for libjpeg. This needs to be done *after* setting the
+   * color mode ("colorspace" in libjpeg terms).
+   */
+  jpeg_set_defaults(cinfo);
+
+  /*
+   * Apply compression settings on top of the defaults
+   */
+  const Compression& compression = settings.compression;
+  jpeg_set_quality(cinfo, compression.quality, true);
+
+  switch (compression.dctMethod) {
+    case DctMethod::Integer: cinfo->dct_method = JDCT_ISLOW; break;
+    case DctMethod::IntegerFast: cinfo->dct_method = JDCT_IFAST; break;
+    case DctMethod::Float: cinfo->dct_method = JDCT_FLOAT; break;
+  }
+
+  set_huffman_tables(cinfo, huffmanTables);
+
+  if (cinfo->jpeg_color_space == JCS_YCbCr) {
+    // Chroma components keep their default 1x1 factors, relative to luma
+    const auto [hSamp, vSamp] = luma_sampling(settings.colorMode, compression.subsampling);
+    cinfo->comp_info[0].h_samp_factor = hSamp;
+    cinfo->comp_info[0].v_samp_factor = vSamp;
+  }
+
+  // Planar input skips libjpeg's color conversion and downsampling
+  cinfo->raw_data_in = is_ycbcr(settings.colorMode);
+
+  cinfo->optimize_coding = compression.optimizeHuffman;
+  if (compression.progressive) jpeg_simple_progression(cinfo);
+
+  cinfo->restart_interval = settings.restartInterval;
+}
+
+Encoder::Encoder() noexcept
+  : m_cinfo(std::make_unique<jpeg_compress_struct>()),
+    m_jerr(std::make_unique<jpeg_error_mgr>()),
+    m_dest(std::make_unique<Destination>()),
+    m_arena(std::make_unique<Arena>()) {
+  m_dest->encoder = this;
+  m_cinfo->err = jpeg_std_error(m_jerr.get());
+  m_jerr->error_exit = error_exit;
+  jpeg_create_compress(m_cinfo.get());
+  m_arena->install(m_cinfo.get());
+}
+
+Encoder::~Encoder() {
+  if (m_cinfo) jpeg_destroy_compress(m_cinfo.get());
+}
+
+/*
+ * The compression object lives on the heap, since libjpeg holds pointers to the
+ * error manager, destination and arena. Moving an encoder hands over ownership of the
+ * whole thing, leaving the source empty.
+ */
+Encoder::Encoder(Encoder&& enc) noexcept
+  : m_cinfo(std::move(enc.m_cinfo)),
+    m_jerr(std::move(enc.m_jerr)),
+    m_dest(std::move(enc.m_dest)),
+    m_arena(std::move(enc.m_arena)),
+    m_pipeline(std::move(enc.m_pipeline)),
+    m_trace(std::move(enc.m_trace)) {
+  if (m_dest) m_dest->encoder = this;
+}
+
+Encoder& Encoder::operator=(Encoder&& enc) noexcept {
+  if (this == &enc) return *this;
+
+  if (m_cinfo) jpeg_destroy_compress(m_cinfo.get());
+  m_cinfo = std::move(enc.m_cinfo);
+  m_jerr = std::move(enc.m_jerr);
+  m_dest = std::move(enc.m_dest);
+  m_arena = std::move(enc.m_arena);
+  m_pipeline = std::move(enc.m_pipeline);
+  m_trace = std::move(enc.m_trace);
+  if (m_dest) m_dest->encoder = this;
+
+  return *this;
+}
+
+void Encoder::encode(void* data, const EncodeParams& params) {
+  FileWriter writer(params.outPath);
+  encode(data, params, writer);
+}
+
+void Encoder::encode(void* data, const EncodeParams& params, Writer& writer) {
+  encode(data, params, writer, {});
+}
+
+void Encoder::encode(void* data, const EncodeParams& params, Writer& writer, const BandOptions& band) {
+  Session session = begin(params, writer, band);
+
+  // Tiled input is addressed from the start of the grid
+  const uint8_t* firstRow = m_pipeline->planar
+                            ? nullptr
+                            : m_pipeline->tiles.width
+                              ? static_cast<const uint8_t*>(data)
+                              : static_cast<const uint8_t*>(data) + m_pipeline->rowStride * params.inRowOffset;
+  session.writeRows(firstRow, params.height);
+  session.finish();
+}
+
+void Encoder::encode(void* data, const EncodeParams& params, std::vector<uint8_t>& out) {
+  out.clear();
+  VectorWriter writer(out);
+  encode(data, params, writer);
+}
+
+void Encoder::encode(const fs::path& input, const EncodeParams& params) {
+  FileWriter writer(params.outPath);
+  encode(input, params, writer);
+}
+
+void Encoder::encode(const fs::path& input, const EncodeParams& params, Writer& writer) {
+  // Size of the chunks rows are read and released in
+  static constexpr uint64_t chunkBytes = 4 * 1024 * 1024;
+
+  if (is_ycbcr(params.colorMode) || params.planes[0].data) {
+    throw Error("Planar input can't be read from a file");
+  }
+  if (params.tiling.width) throw Error("Tiled input can't be read from a file");
+
+  auto file = open_input(input);
+  Session session = begin(params, writer);
+  const Pipeline& pipeline = *m_pipeline;
+
+  /*
+   * Byte range of the file holding the image, from the start of the first row
+   * to the last sample of the last row
+   */
+  const uint64_t rowStride = pipeline.rowStride;
+  const uint64_t rowExtent = pipeline.rowOffset
+                             + uint64_t(pipeline.layout.pixelStride) * (params.width - 1)
+                             + uint64_t(pipeline.layout.channelStride) * pipeline.layout.components;
+  const uint64_t begin = rowStride * params.inRowOffset;
+  const uint64_t end = begin + rowStride * (params.height - 1) + rowExtent;
+  if (input_size(file.get()) < end) throw Error("Input file is too small for the image");
+
+  // Whole strips per chunk, so rows are converted and compressed as they're read
+  const uint32_t chunkRows = std::max(
+    pipeline.stripHeight,
+    uint32_t(std::min<uint64_t>(chunkBytes / std::max<uint64_t>(rowStride, 1), params.height))
+    / pipeline.stripHeight * pipeline.stripHeight
+  );
+
+  if (MappedInput mapped(file.get(), begin, end); mapped) {
+    for (uint32_t iRow = 0; iRow < params.height; iRow += chunkRows) {
+      const uint32_t nRows = std::min(chunkRows, params.height - iRow);
+      session.writeRows(mapped.at(begin + rowStride * iRow), nRows);
+      mapped.release(begin + rowStride * (iRow + nRows));
+    }
+  } else {
+    uint8_t* buffer = m_arena->allocate<uint8_t>(rowStride * (chunkRows - 1) + rowExtent);
+    for (uint32_t iRow = 0; iRow < params.height; iRow += chunkRows) {
+      const uint32_t nRows = std::min(chunkRows, params.height - iRow);
+      const size_t size = rowStride * (nRows - 1) + rowExtent;
+
+      seek_input(file.get(), begin + rowStride * iRow);
+      if (std::fread(buffer, 1, size, file.get()) != size) {
+        if (std::ferror(file.get())) throw std::system_error(errno, std::generic_category(), "fread");
+        throw Error("Input file is too small for the image");
+      }
+      session.writeRows(buffer, nRows);
+    }
+  }
+
+  session.finish();
+}
+
+void Encoder::encode(const fs::path& input, const EncodeParams& params, std::vector<uint8_t>& out) {
+  out.clear();
+  VectorWriter writer(out);
+  encode(input, params, writer);
+}
+
+Encoder::Session Encoder::begin(const EncodeParams& params, Writer& writer) {
+  return begin(params, writer, {});
+}
+
+void Encoder::setTraceCallback(TraceCallback callback) {
+  m_trace = std::move(callback);
+}
+
+void Encoder::setMemoryLimit(size_t bytes) {
+  m_arena->limit = bytes > 0 ? bytes : SIZE_MAX;
+}
+
+size_t Encoder::memoryHighWater() const noexcept {
+  return m_arena ? m_arena->highWater : 0;
+}
+
+HuffmanTables HuffmanTables::fromSample(void* data, const EncodeParams& params) {
+  EncodeParams sampleParams = params;
+  sampleParams.compression.optimizeHuffman = true;
+  sampleParams.compression.progressive = false;
+  sampleParams.compression.huffmanTables = nullptr;
+  sampleParams.compression.targetBytes = 0;
+  sampleParams.stats = nullptr;
+
+  // Optimizing overwrites the tables in the compression object, where they're picked up
+  Encoder encoder;
+  CallbackWriter discard([](const uint8_t*, size_t) {});
+  encoder.encode(data, sampleParams, discard);
+
+  HuffmanTables tables;
+  j_compress_ptr cinfo = encoder.m_cinfo.get();
+  tables.m_tables = {
+    *cinfo->dc_huff_tbl_ptrs[0], *cinfo->dc_huff_tbl_ptrs[1],
+    *cinfo->ac_huff_tbl_ptrs[0], *cinfo->ac_huff_tbl_ptrs[1],
+  };
+  for (size_t i = 0; i < tables.m_tables.size(); i++) complete_huffman_table(tables.m_tables[i], i >= 2);
+
+  return tables;
+}
+
+Encoder::Session Encoder::begin(const EncodeParams& params, Writer& writer, const BandOptions& band) {
+  const bool created = !m_pipeline;
+  if (created) m_pipeline = std::make_unique<Pipeline>();
+  if (m_pipeline->active) throw Error("Encoder is already in use by another session");
+
+  Pipeline& pipeline = *m_pipeline;
+  pipeline.stats = params.stats;
+  pipeline.timed = params.stats || m_trace;
+  pipeline.beginTime = pipeline.timed ? Clock::now() : Clock::time_point();
+  pipeline.nestedOutputTime = {};
+  pipeline.arenaAllocations = m_arena->allocations;
+  if (params.stats) *params.stats = {.allocations = created};
+
+  m_dest->writer = &writer;
+  m_dest->bytesWritten = 0;
+  m_cinfo->dest = m_dest.get();
+
+  try {
+    start(params, band);
+  } catch (...) {
+    abort();
+    throw;
+  }
+
+  return Session(this);
+}
+
+/*
+ * Checks the conversion options of params against the pixel format
+ */
+static void check_conversion(const EncodeParams& params) {
+  if (params.toneCurve && params.pixelFormat != PixelFormat::Uint16) {
+    throw Error("Tone curves can only be used with Uint16 input");
+  }
+  if (params.linearInput && params.pixelFormat != PixelFormat::Float16
+      && params.pixelFormat != PixelFormat::Float32 && params.pixelFormat != PixelFormat::Float64) {
+    throw Error("Linear input must be in a floating point format");
+  }
+}
+
+/*
+ * Layout of the input described by params, converted to the given number of
+ * components. Samples in a plane are always packed.
+ */
+static RowLayout input_layout(const EncodeParams& params, uint32_t components, bool planar) {
+  const uint32_t nChannels = params.inChannels == -1 || planar ? components : params.inChannels;
+  const uint32_t channelStride = params.channelStride();
+
+  return {
+    .inChannels = nChannels,
+    .components = components,
+    .channelStride = channelStride,
+    .pixelStride = params.inPixelStride == -1 || planar
+                   ? channelStride * (planar ? 1 : nChannels)
+                   : params.inPixelStride,
+    .toneCurve = params.toneCurve ? params.toneCurve->table() : nullptr,
+    .linear = params.linearInput.has_value(),
+    .gamutMatrix = params.linearInput ? gamut_matrix(*params.linearInput, params.colorSpace) : nullptr,
+  };
+}
+
+void Encoder::start(const EncodeParams& params, const BandOptions& band) {
+  Pipeline& pipeline = *m_pipeline;
+  const auto setupStart = pipeline.timed ? Clock::now() : Clock::time_point();
+
+  check_conversion(params);
+
+  const bool raw = is_ycbcr(params.colorMode);
+  const bool planar = raw || params.planes[0].data;
+  if (planar) {
+    const size_t nPlanes = params.colorMode == ColorMode::Grayscale ? 1 : 3;
+    for (size_t iPlane = 0; iPlane < nPlanes; iPlane++) {
+      if (!params.planes[iPlane].data) throw Error("Planar input needs a plane for every component");
+    }
+  }
+  if (raw) {
+    if (params.pixelFormat != PixelFormat::Uint8) throw Error("Planar YCbCr input must be Uint8");
+
+    const auto [hSamp, vSamp] = luma_sampling(params);
+    if (params.inPixelOffset % hSamp != 0 || params.inRowOffset % vSamp != 0) {
+      throw Error("Offsets into planar input must be multiples of the chroma subsampling");
+    }
+  }
+  const Tiling& tiling = params.tiling;
+  if (tiling.width || tiling.height) {
+    if (!tiling.width || !tiling.height) throw Error("Tiles need both a width and a height");
+    if (planar) throw Error("Tiled input can't be planar");
+  }
+
+  /*
+   * Configure the compression object with image parameters
+   */
+  m_cinfo->image_width = params.width;
+  m_cinfo->image_height = params.height;
+
+  CompressionSettings settings = {
+    .colorMode = params.colorMode,
+    .compression = params.compression,
+    .restartInterval = band.restartInterval ? band.restartInterval : params.compression.restartInterval,
+  };
+  Pipeline::TargetState& target = pipeline.target;
+  target.bytes = params.compression.targetBytes;
+  if (target.bytes) {
+    target.settings = settings;
+    target.profile = band.embedProfile ? std::optional(params.colorSpace) : std::nullopt;
+    target.writer = m_dest->writer;
+    // Nothing is kept from the first pass but its coefficients
+    m_dest->writer = &target.outputs[0];
+    settings.compression = {
+      .quality = 100,
+      .subsampling = params.compression.subsampling,
+      .dctMethod = params.compression.dctMethod,
+      .progressive = true,
+    };
+    settings.restartInterval = 0;
+  }
+  if (EncodeStats* stats = pipeline.stats) stats->quality = params.compression.quality;
+
+  // Optimized tables are computed per image, replacing whichever are installed
+  const Compression& compression = settings.compression;
+  const bool sharedTables = compression.huffmanTables && !compression.optimizeHuffman && !compression.progressive;
+  if (pipeline.settings != settings) {
+    // Configured from scratch, so a failure part way leaves nothing to reuse
+    pipeline.settings.reset();
+    configure(
+      m_cinfo.get(), settings, sharedTables ? compression.huffmanTables->m_tables : standard_huffman_tables()
+    );
+    pipeline.settings = settings;
+  } else if (sharedTables) {
+    // The settings only hold the tables' address, whose contents may have been replaced since
+    set_huffman_tables(m_cinfo.get(), compression.huffmanTables->m_tables);
+  }
+
+  /*
+   * Calculate parameters
+   */
+  const RowLayout layout = input_layout(params, m_cinfo->input_components, planar);
+  const uint32_t channelStride = layout.channelStride;
+  const uint32_t pixelStride = layout.pixelStride;
+  uint32_t rowStride = params.inRowStride == -1
+                       ? pixelStride * (tiling.width ? tiling.width : params.width)
+                       : params.inRowStride;
+
+  /*
+   * Initialize compression op
+   */
+  jpeg_start_compress(m_cinfo.get(), true);
+
+  /*
+   * Set up the conversion pipeline
+   * Rows are converted and submitted in strips of one MCU row (8 or 16 rows,
+   * depending on sampling factors), so libjpeg is entered once per strip and
+   * reads the converted rows while they're still in cache.
+   */
+  pipeline.stripHeight = m_cinfo->max_v_samp_factor * DCTSIZE;
+  pipeline.rowsWritten = 0;
+  pipeline.planar = planar;
+  pipeline.raw = raw;
+
+  pipeline.layout = layout;
+  pipeline.convertRow = select_row_converter(params.pixelFormat, pipeline.layout);
+  pipeline.convertPlanes = planar && !raw && m_cinfo->input_components == 3
+                           ? select_planar_converter(params.pixelFormat, pipeline.layout)
+                           : nullptr;
+  pipeline.zeroCopy = !pipeline.convertPlanes && !tiling.width && is_zero_copy(params.pixelFormat, pipeline.layout);
+
+  pipeline.width = params.width;
+  pipeline.rowStride = rowStride;
+  pipeline.rowOffset = planar ? 0 : size_t(pixelStride) * params.inPixelOffset + size_t(channelStride) * params.inChannelOffset;
+  pipeline.tiles = {};
+  if (tiling.width) startTiles(params);
+  pipeline.rowBytes = sizeof(uint8_t) * m_cinfo->input_components * params.width;
+
+  pipeline.stripBuffer = pipeline.zeroCopy || raw
+                         ? nullptr
+                         : m_arena->allocate<uint8_t>(pipeline.rowBytes * pipeline.stripHeight);
+  pipeline.stripRows = raw ? nullptr : m_arena->allocate<JSAMPROW>(pipeline.stripHeight);
+  if (planar) startPlanes(params);
+
+  pipeline.active = true;
+  if (pipeline.timed) record(EncodePhase::Setup, setupStart);
+
+  /*
+   * Embed ICC profile data
+   * Written after setting up the pipeline, since markers may go anywhere
+   * between starting compression and writing the first scanline.
+   */
+  const auto markerStart = pipeline.timed ? Clock::now() : Clock::time_point();
+  if (band.embedProfile && !target.bytes) {
+    // The profiles are serialized once, then copied to each image
+    const std::vector<uint8_t>& segments = icc_profile_segments(params.colorSpace);
+    m_dest->append(m_cinfo.get(), segments.data(), segments.size());
+  }
+  if (pipeline.timed) record(EncodePhase::Markers, markerStart);
+}
+
+/*
+ * Sets up the planes for planar input. Raw planes use the component sizes
+ * libjpeg computed when starting compression.
+ */
+void Encoder::startPlanes(const EncodeParams& params) {
+  Pipeline& pipeline = *m_pipeline;
+
+  if (!pipeline.raw) {
+    for (int iPlane = 0; iPlane < m_cinfo->input_components; iPlane++) {
+      const Plane& input = params.planes[iPlane];
+      Pipeline::PlaneState& plane = pipeline.planes[iPlane];
+
+      plane.rowStride = input.rowStride == -1 ? pipeline.layout.channelStride * params.width : input.rowStride;
+      plane.data = static_cast<const uint8_t*>(input.data)
+                   + plane.rowStride * params.inRowOffset
+                   + size_t(pipeline.layout.channelStride) * params.inPixelOffset;
+    }
+
+    // A single plane is read like any other buffer of packed pixels
+    pipeline.rowStride = pipeline.planes[0].rowStride;
+    return;
+  }
+
+  pipeline.zeroCopy = true;
+  for (int iPlane = 0; iPlane < 3; iPlane++) {
+    const jpeg_component_info& comp = m_cinfo->comp_info[iPlane];
+    const Plane& input = params.planes[iPlane];
+    Pipeline::PlaneState& plane = pipeline.planes[iPlane];
+
+    const uint32_t hScale = m_cinfo->max_h_samp_factor / comp.h_samp_factor;
+    const uint32_t vScale = m_cinfo->max_v_samp_factor / comp.v_samp_factor;
+
+    plane.width = comp.downsampled_width;
+    plane.height = comp.downsampled_height;
+    plane.paddedWidth = comp.width_in_blocks * DCTSIZE;
+    plane.stripHeight = comp.v_samp_factor * DCTSIZE;
+    plane.rowStride = input.rowStride == -1 ? plane.width : input.rowStride;
+    plane.data = static_cast<const uint8_t*>(input.data)
+                 + plane.rowStride * (params.inRowOffset / vScale)
+                 + params.inPixelOffset / hScale;
+
+    plane.buffer = plane.paddedWidth == plane.width
+                   ? nullptr
+                   : m_arena->allocate<uint8_t>(size_t(plane.paddedWidth) * plane.stripHeight);
+    plane.rows = m_arena->allocate<JSAMPROW>(plane.stripHeight);
+
+    if (plane.buffer) pipeline.zeroCopy = false;
+  }
+}
+
+/*
+ * Number of tiles in a row (or column, for column-major order) of the grid of
+ * tiled input
+ */
+static uint32_t tile_grid_stride(const EncodeParams& params) {
+  const Tiling& tiling = params.tiling;
+  if (tiling.gridStride) return tiling.gridStride;
+
+  return tiling.order == TileOrder::RowMajor
+         ? (params.inPixelOffset + params.width + tiling.width - 1) / tiling.width
+         : (params.inRowOffset + params.height + tiling.height - 1) / tiling.height;
+}
+
+/*
+ * Sets up the tile grid for tiled input
+ */
+void Encoder::startTiles(const EncodeParams& params) {
+  Pipeline& pipeline = *m_pipeline;
+  const Tiling& tiling = params.tiling;
+  Pipeline::TileState& tiles = pipeline.tiles;
+
+  const size_t tileStride = tiling.stride == -1 ? pipeline.rowStride * tiling.height : size_t(tiling.stride);
+  const uint32_t gridStride = tile_grid_stride(params);
+
+  tiles.width = tiling.width;
+  tiles.height = tiling.height;
+  tiles.columnStride = tiling.order == TileOrder::RowMajor ? tileStride : tileStride * gridStride;
+  tiles.rowStride = tiling.order == TileOrder::RowMajor ? tileStride * gridStride : tileStride;
+  tiles.originX = params.inPixelOffset;
+  tiles.originY = params.inRowOffset;
+
+  // Pixel offsets are applied per tile
+  pipeline.rowOffset = size_t(pipeline.layout.channelStride) * params.inChannelOffset;
+}
+
+/*
+ * Compresses every strip of planar input whose rows have all been written
+ * jpeg_write_raw_data takes exactly one strip at a time. Rows past the bottom
+ * of a plane repeat its last row.
+ */
+void Encoder::writeRaw() {
+  Pipeline& pipeline = *m_pipeline;
+  const uint32_t height = m_cinfo->image_height;
+
+  while (m_cinfo->next_scanline < height) {
+    const uint32_t firstRow = m_cinfo->next_scanline;
+    if (pipeline.rowsWritten < std::min(firstRow + pipeline.stripHeight, height)) break;
+
+    const uint32_t iStrip = firstRow / pipeline.stripHeight;
+    auto start = pipeline.timed ? Clock::now() : Clock::time_point();
+
+    JSAMPARRAY planeRows[3];
+    for (int iPlane = 0; iPlane < 3; iPlane++) {
+      Pipeline::PlaneState& plane = pipeline.planes[iPlane];
+      const uint32_t firstPlaneRow = iStrip * plane.stripHeight;
+
+      for (uint32_t iRow = 0; iRow < plane.stripHeight; iRow++) {
+        const uint8_t* src = plane.data + plane.rowStride * std::min(firstPlaneRow + iRow, plane.height - 1);
+        if (!plane.buffer) {
+          plane.rows[iRow] = const_cast<JSAMPROW>(src);
+        } else {
+          uint8_t* dst = plane.buffer + size_t(plane.paddedWidth) * iRow;
+          std::memcpy(dst, src, plane.width);
+          std::memset(dst + plane.width, src[plane.width - 1], plane.paddedWidth - plane.width);
+          plane.rows[iRow] = dst;
+        }
+      }
+      planeRows[iPlane] = plane.rows;
+
+      if (EncodeStats* stats = pipeline.stats) {
+        const uint32_t planeRowsRead = std::min(plane.stripHeight, plane.height - std::min(firstPlaneRow, plane.height));
+        stats->bytesIn += uint64_t(planeRowsRead) * plane.width;
+      }
+    }
+
+    if (pipeline.timed && !pipeline.zeroCopy) start = record(EncodePhase::Conversion, start, pipeline.stripHeight);
+
+    jpeg_write_raw_data(m_cinfo.get(), planeRows, pipeline.stripHeight);
+    if (pipeline.timed) record(EncodePhase::Compression, start, pipeline.stripHeight);
+  }
+}
+
+/*
+ * Converts rows of tiled input into the strip buffer
+ * The rows are walked one tile at a time, top to bottom within each tile, so
+ * only the tiles covering the rows are read, each sequentially.
+ */
+void Encoder::convertTiles(const uint8_t* data, uint32_t firstRow, uint32_t nRows) {
+  Pipeline& pipeline = *m_pipeline;
+  const Pipeline::TileState& tiles = pipeline.tiles;
+  const RowLayout& layout = pipeline.layout;
+
+  for (uint32_t iRow = 0; iRow < nRows; iRow++) {
+    pipeline.stripRows[iRow] = pipeline.stripBuffer + pipeline.rowBytes * iRow;
+  }
+
+  for (uint32_t iRow = 0; iRow < nRows;) {
+    // Rows of this strip within the same row of tiles
+    const uint32_t y = tiles.originY + firstRow + iRow;
+    const uint32_t tileY = y % tiles.height;
+    const uint32_t tileRows = std::min(nRows - iRow, tiles.height - tileY);
+    const uint8_t* tileRow = data + tiles.rowStride * (y / tiles.height)
+                             + pipeline.rowStride * tileY + pipeline.rowOffset;
+
+    for (uint32_t iPixel = 0; iPixel < pipeline.width;) {
+      const uint32_t x = tiles.originX + iPixel;
+      const uint32_t tileX = x % tiles.width;
+      const uint32_t tilePixels = std::min(pipeline.width - iPixel, tiles.width - tileX);
+      const uint8_t* src = tileRow + tiles.columnStride * (x / tiles.width) + size_t(layout.pixelStride) * tileX;
+
+      for (uint32_t i = 0; i < tileRows; i++) {
+        uint8_t* dst = pipeline.stripRows[iRow + i] + size_t(layout.components) * iPixel;
+        pipeline.convertRow(src + pipeline.rowStride * i, dst, tilePixels, layout);
+      }
+      iPixel += tilePixels;
+    }
+    iRow += tileRows;
+  }
+}
+
+void Encoder::writeRows(const void* data, uint32_t nRows) {
+  Pipeline& pipeline = *m_pipeline;
+  if (nRows > m_cinfo->image_height - pipeline.rowsWritten) {
+    throw Error("Too many rows written for the image height");
+  }
+
+  if (pipeline.raw) {
+    pipeline.rowsWritten += nRows;
+    writeRaw();
+    if (pipeline.stats) pipeline.stats->scanlines = pipeline.rowsWritten;
+    return;
+  }
+
+  // Planar input continues from the last row written
+  const uint8_t* firstRow = pipeline.planar
+                            ? pipeline.planes[0].data + pipeline.rowStride * pipeline.rowsWritten
+                            : static_cast<const uint8_t*>(data) + pipeline.rowOffset;
+
+  for (uint32_t iStrip = 0; iStrip < nRows; iStrip += pipeline.stripHeight) {
+    const uint32_t stripRows = std::min(pipeline.stripHeight, nRows - iStrip);
+    auto start = pipeline.timed ? Clock::now() : Clock::time_point();
+
+    if (pipeline.tiles.width) {
+      // Tiled input also continues from the last row written
+      convertTiles(static_cast<const uint8_t*>(data), pipeline.rowsWritten + iStrip, stripRows);
+    } else {
+      for (uint32_t iRow = 0; iRow < stripRows; iRow++) {
+        const uint8_t* src = firstRow + pipeline.rowStride * (iStrip + iRow);
+        if (pipeline.convertPlanes) {
+          // Gather the row from each plane, interleaving as it's converted
+          const size_t planeRow = pipeline.rowsWritten + iStrip + iRow;
+          const uint8_t* planes[3];
+          for (int iPlane = 0; iPlane < 3; iPlane++) {
+            planes[iPlane] = pipeline.planes[iPlane].data + pipeline.planes[iPlane].rowStride * planeRow;
+          }
+
+          pipeline.stripRows[iRow] = pipeline.stripBuffer + pipeline.rowBytes * iRow;
+          pipeline.convertPlanes(planes, pipeline.stripRows[iRow], pipeline.width, pipeline.layout);
+        } else if (pipeline.zeroCopy) {
+          /*
+           * The input rows are already laid out the way libjpeg wants them, so
+           * pass pointers into the input buffer straight through. libjpeg only
+           * reads from the rows it's given.
+           */
+          pipeline.stripRows[iRow] = const_cast<JSAMPROW>(src);
+        } else {
+          /*
+           * Copy a scanline's worth of data from the input buffer to the strip
+           * buffer, adapting to the expected 8bpc integer format
+           */
+          pipeline.stripRows[iRow] = pipeline.stripBuffer + pipeline.rowBytes * iRow;
+          pipeline.convertRow(src, pipeline.stripRows[iRow], pipeline.width, pipeline.layout);
+        }
+      }
+    }
+
+    if (pipeline.timed && !pipeline.zeroCopy) start = record(EncodePhase::Conversion, start, stripRows);
+
+    jpeg_write_scanlines(m_cinfo.get(), pipeline.stripRows, stripRows);
+    if (pipeline.timed) record(EncodePhase::Compression, start, stripRows);
+  }
+
+  pipeline.rowsWritten += nRows;
+  if (EncodeStats* stats = pipeline.stats) {
+    const size_t pixelBytes = pipeline.planar
+                              ? pipeline.layout.channelStride * pipeline.layout.components
+                              : pipeline.layout.pixelStride;
+    stats->bytesIn += uint64_t(nRows) * pipeline.width * pixelBytes;
+    stats->scanlines = pipeline.rowsWritten;
+  }
+}
+
+void Encoder::finish() {
+  Pipeline& pipeline = *m_pipeline;
+  const auto start = pipeline.timed ? Clock::now() : Clock::time_point();
+
+  if (pipeline.target.bytes) {
+    finishToTarget();
+  } else {
+    // Compresses the last MCU row and flushes the writer
+    jpeg_finish_compress(m_cinfo.get());
+  }
+
+  if (pipeline.timed) {
+    const auto end = record(EncodePhase::Compression, start);
+    if (EncodeStats* stats = pipeline.stats) stats->totalTime = end - pipeline.beginTime;
+  }
+  if (EncodeStats* stats = pipeline.stats) {
+    stats->bytesOut = m_dest->bytesWritten;
+    // The arena was released when compression finished, taking note of what it used
+    stats->peakBufferBytes = std::max(stats->peakBufferBytes, m_arena->lastUsed) + m_dest->buffer.size();
+    stats->allocations += m_arena->allocations - pipeline.arenaAllocations;
+  }
+
+  pipeline.active = false;
+}
+
+/*
+ * Quantizes coefficients computed with every quantizer at 1
+ * Ties, which only even quantizers have, round towards zero, since rounding in
+ * the first pass may be what pushed them up to the tie. Multiplying by a float
+ * reciprocal lets the loop vectorize, and is exact for any 16-bit coefficient
+ * and quantizer, as the half step added keeps results away from integers by
+ * far more than the error of the reciprocal.
+ */
+static void quantize_blocks(
+  const JCOEF* __restrict in, JCOEF* __restrict out, size_t nBlocks, const JQUANT_TBL& table
+) {
+  alignas(64) std::array<float, DCTSIZE2> reciprocals;
+  alignas(64) std::array<float, DCTSIZE2> offsets;
+  for (size_t k = 0; k < DCTSIZE2; k++) {
+    const uint32_t q = table.quantval[k];
+    reciprocals[k] = 1.0f / float(q);
+    offsets[k] = float((q - 1) / 2) + 0.5f;
+  }
+
+  for (size_t i = 0; i < nBlocks * DCTSIZE2; i += DCTSIZE2) {
+    for (size_t k = 0; k < DCTSIZE2; k++) {
+      const int32_t value = in[i + k];
+      const auto quantized = int32_t((float(value < 0 ? -value : value) + offsets[k]) * reciprocals[k]);
+      out[i + k] = JCOEF(value < 0 ? -quantized : quantized);
+    }
+  }
+}
+
+/*
+ * Finishes an image with a target size
+ * The coefficients of the quality 100 pass are copied out of libjpeg's arrays
+ * before releasing them, then trials search for the highest quality that fits,
+ * starting with the requested one, which is all it takes when the image fits
+ * as requested. The output of the chosen trial goes to the writer.
+ */
+void Encoder::finishToTarget() {
+  Pipeline& pipeline = *m_pipeline;
+  Pipeline::TargetState& target = pipeline.target;
+  j_compress_ptr cinfo = m_cinfo.get();
+
+  if (cinfo->next_scanline < cinfo->image_height) ERREXIT(cinfo, JERR_TOO_LITTLE_DATA);
+
+  // The coefficient controller requests an array per component in order, and the arena lists them newest first
+  std::array<Arena::VirtualArray*, MAX_COMPONENTS> arrays{};
+  int nArrays = 0;
+  for (Arena::VirtualArray* array = m_arena->virtualArrays; array; array = array->next) {
+    if (!array->isBlocks) continue;
+    if (nArrays == cinfo->num_components) throw Error("Unexpected coefficient arrays for rate control");
+    arrays[nArrays++] = array;
+  }
+  if (nArrays != cinfo->num_components) throw Error("Unexpected coefficient arrays for rate control");
+  std::reverse(arrays.begin(), arrays.begin() + nArrays);
+
+  size_t nCoefficients = 0;
+  for (int iComp = 0; iComp < nArrays; iComp++) {
+    target.blocks[iComp] = {arrays[iComp]->width, arrays[iComp]->height};
+    nCoefficients += size_t(arrays[iComp]->width) * arrays[iComp]->height * DCTSIZE2;
+  }
+  const size_t capacity = target.coefficients.capacity();
+  target.coefficients.resize(nCoefficients);
+  if (pipeline.stats && target.coefficients.capacity() != capacity) pipeline.stats->allocations++;
+
+  JCOEF* coefficients = target.coefficients.data();
+  for (int iComp = 0; iComp < nArrays; iComp++) {
+    const Arena::VirtualArray& array = *arrays[iComp];
+    for (JDIMENSION iRow = 0; iRow < array.height; iRow++) {
+      std::memcpy(coefficients, array.blocks[iRow], sizeof(JBLOCK) * array.width);
+      coefficients += size_t(array.width) * DCTSIZE2;
+    }
+  }
+
+  // Releases the first pass, along with the arena
+  const size_t firstPassBytes = m_arena->used;
+  jpeg_abort_compress(cinfo);
+
+  /*
+   * Search for the highest quality that fits
+   * Output size falls about in proportion to libjpeg's quality scaling factor,
+   * so each guess interpolates the log of the size against the log of the
+   * factor, between the closest qualities found to fit and not to fit, or
+   * extrapolates from the last two that didn't fit until one does. Once the
+   * answer is bracketed, steps that don't halve the bracket are followed by a
+   * bisection. Trials alternate between the two outputs, keeping the best one
+   * that fits.
+   */
+  MemoryWriter* best = &target.outputs[0];
+  MemoryWriter* trial = &target.outputs[1];
+  // Quality 100 scales by 0%, taken as 1% to keep the log finite. Sizes don't grow without bound
+  // towards it like the factor shrinks, so it's never interpolated from.
+  const auto log_scale = [](int quality) { return std::log(double(std::max(jpeg_quality_scaling(quality), 1))); };
+  const double logTarget = std::log(double(target.bytes));
+  const int highest = std::clamp(target.settings.compression.quality, 1, 100);
+  // Highest quality known to fit (0 = none yet), and lowest known not to
+  int fits = 0;
+  int fails = highest + 1;
+  // Other end of the guess: fits, or until something does, the previous trial (0 = none)
+  int anchor = 0;
+  double fitsLogSize = 0;
+  double failsLogSize = 0;
+  double anchorLogSize = 0;
+  bool bisect = false;
+  for (int quality = fails - 1;;) {
+    const int bracket = fails - fits;
+    compressTrial(quality, *trial);
+    const double logSize = std::log(double(trial->size()));
+    if (trial->size() <= target.bytes) {
+      fits = quality;
+      fitsLogSize = logSize;
+      std::swap(best, trial);
+    } else {
+      anchor = fails > highest || fails == 100 ? 0 : fails;
+      anchorLogSize = failsLogSize;
+      fails = quality;
+      failsLogSize = logSize;
+    }
+    if (fails - fits <= 1) break;
+
+    if (bisect) {
+      quality = (fits + fails) / 2;
+    } else {
+      if (fits) {
+        anchor = fits;
+        anchorLogSize = fitsLogSize;
+      }
+      // With a single trial, assume size is inversely proportional to the factor
+      const double logScale = anchor
+                              ? log_scale(fails) + (logTarget - failsLogSize) * (log_scale(anchor) - log_scale(fails))
+                                                   / (anchorLogSize - failsLogSize)
+                              : log_scale(fails) + failsLogSize - logTarget;
+      // The highest quality predicted to fit
+      quality = fits + 1;
+      while (quality + 1 < fails && log_scale(quality + 1) >= logScale) quality++;
+    }
+    bisect = fits && !bisect && 2 * (fails - fits) > bracket;
+  }
+  // Nothing fits, so the last trial was quality 1
+  const MemoryWriter& output = fits ? *best : *trial;
+
+  // The trials left the compression object configured for themselves
+  pipeline.settings.reset();
+
+  const auto outputStart = pipeline.timed ? Clock::now() : Clock::time_point();
+  m_dest->writer = target.writer;
+  target.writer->write(output.data(), output.size());
+  target.writer->flush();
+  m_dest->bytesWritten = output.size();
+  if (pipeline.timed) record(EncodePhase::Output, outputStart, 0, output.size());
+
+  if (EncodeStats* stats = pipeline.stats) {
+    stats->quality = fits ? fits : 1;
+    stats->peakBufferBytes = firstPassBytes + sizeof(JCOEF) * target.coefficients.capacity()
+                             + target.outputs[0].buffer().capacity() + target.outputs[1].buffer().capacity();
+  }
+}
+
+/*
+ * Compresses the coefficients kept for rate control at a quality, to out
+ */
+void Encoder::compressTrial(int quality, MemoryWriter& out) {
+  Pipeline::TargetState& target = m_pipeline->target;
+  j_compress_ptr cinfo = m_cinfo.get();
+
+  CompressionSettings settings = target.settings;
+  settings.compression.quality = quality;
+  const Compression& compression = settings.compression;
+  const bool sharedTables = compression.huffmanTables && !compression.optimizeHuffman && !compression.progressive;
+  configure(cinfo, settings, sharedTables ? compression.huffmanTables->m_tables : standard_huffman_tables());
+
+  out.clear();
+  m_dest->writer = &out;
+
+  std::array<jvirt_barray_ptr, MAX_COMPONENTS> arrays{};
+  for (int iComp = 0; iComp < cinfo->num_components; iComp++) {
+    const auto [width, height] = target.blocks[iComp];
+    arrays[iComp] = (*cinfo->mem->request_virt_barray)(
+      reinterpret_cast<j_common_ptr>(cinfo), JPOOL_IMAGE, FALSE, width, height, cinfo->comp_info[iComp].v_samp_factor
+    );
+  }
+  jpeg_write_coefficients(cinfo, arrays.data());
+
+  if (target.profile) {
+    const std::vector<uint8_t>& segments = icc_profile_segments(*target.profile);
+    m_dest->append(cinfo, segments.data(), segments.size());
+  }
+
+  const JCOEF* coefficients = target.coefficients.data();
+  for (int iComp = 0; iComp < cinfo->num_components; iComp++) {
+    const auto [width, height] = target.blocks[iComp];
+    const JQUANT_TBL& table = *cinfo->quant_tbl_ptrs[cinfo->comp_info[iComp].quant_tbl_no];
+    for (JDIMENSION iRow = 0; iRow < height; iRow++) {
+      JBLOCKARRAY rows = (*cinfo->mem->access_virt_barray)(
+        reinterpret_cast<j_common_ptr>(cinfo), arrays[iComp], iRow, 1, TRUE
+      );
+      quantize_blocks(coefficients, rows[0][0], width, table);
+      coefficients += size_t(width) * DCTSIZE2;
+    }
+  }
+
+  jpeg_finish_compress(cinfo);
+}
+
+void Encoder::abort() {
+  // Leave the compression object ready for the next image
+  jpeg_abort_compress(m_cinfo.get());
+  m_pipeline->active = false;
+}
+
+bool Encoder::timed() const noexcept {
+  return m_pipeline && m_pipeline->timed;
+}
+
+/*
+ * Reports a span of an encode that started at start and ends now, returning
+ * the end time so consecutive spans can share a clock read
+ * Output spans nest inside the others, so their time is taken out of the
+ * enclosing phase's stats.
+ */
+Clock::time_point Encoder::record(EncodePhase phase, Clock::time_point start, uint32_t rows, size_t bytes) {
+  Pipeline& pipeline = *m_pipeline;
+  const auto end = Clock::now();
+  const auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+
+  if (phase == EncodePhase::Output) {
+    pipeline.nestedOutputTime += duration;
+  }
+
+  if (EncodeStats* stats = pipeline.stats) {
+    const auto ownTime = phase == EncodePhase::Output ? duration : duration - pipeline.nestedOutputTime;
+    switch (phase) {
+      case EncodePhase::Setup: stats->setupTime += ownTime; break;
+      case EncodePhase::Markers: stats->markerTime += ownTime; break;
+      case EncodePhase::Conversion: stats->conversionTime += ownTime; break;
+      case EncodePhase::Compression: stats->compressionTime += ownTime; break;
+      case EncodePhase::Output: stats->outputTime += ownTime; break;
+    }
+  }
+  if (phase != EncodePhase::Output) pipeline.nestedOutputTime = {};
+
+  if (m_trace) {
+    m_trace({.phase = phase, .start = start, .duration = duration, .rows = rows, .bytes = bytes});
+  }
+
+  return end;
+}
+
+/*
+ * Encode session
+ */
+Encoder::Session::Session(Encoder* encoder) noexcept: m_encoder(encoder) {}
+
+Encoder::Session::Session(Session&& session) noexcept: m_encoder(std::exchange(session.m_encoder, nullptr)) {}
+
+Encoder::Session& Encoder::Session::operator=(Session&& session) noexcept {
+  if (this == &session) return *this;
+
+  if (m_encoder) m_encoder->abort();
+  m_encoder = std::exchange(session.m_encoder, nullptr);
+
+  return *this;
+}
+
+Encoder::Session::~Session() {
+  // A session dropped before finishing discards the image
+  if (m_encoder) m_encoder->abort();
+}
+
+void Encoder::Session::writeRows(const void* data, uint32_t nRows) {
+  if (!m_encoder) throw Error("Session is not active");
+
+  try {
+    m_encoder->writeRows(data, nRows);
+  } catch (...) {
+    std::exchange(m_encoder, nullptr)->abort();
+    throw;
+  }
+}
+
+void Encoder::Session::finish() {
+  if (!m_encoder) throw Error("Session is not active");
+
+  try {
+    m_encoder->finish();
+    m_encoder = nullptr;
+  } catch (...) {
+    std::exchange(m_encoder, nullptr)->abort();
+    throw;
+  }
+}
+
+uint32_t Encoder::Session::rowsWritten() const noexcept {
+  return m_encoder ? m_encoder->m_pipeline->rowsWritten : 0;
+}
+
+/*
+ * Encoder pool
+ */
+struct EncoderPool::Worker {
+  std::thread thread;
+
+  // Queued tasks; the owner takes from the front, thieves from the back
+  std::mutex mutex;
+  std::deque<Task> tasks;
+};
+
+EncoderPool::EncoderPool(size_t threads) {
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+  m_encoders.resize(threads);
+  for (size_t i = 0; i < threads; i++) m_workers.push_back(std::make_unique<Worker>());
+  for (size_t i = 0; i < threads; i++) m_workers[i]->thread = std::thread(&EncoderPool::run, this, i);
+}
+
+EncoderPool::~EncoderPool() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_stopping = true;
+  }
+  m_wake.notify_all();
+
+  for (auto& worker: m_workers) worker->thread.join();
+}
+
+void EncoderPool::encodeBatch(std::span<const EncodeJob> jobs, const CompletionCallback& onComplete) {
+  std::latch done(ptrdiff_t(jobs.size()));
+  std::mutex errorMutex;
+  std::exception_ptr firstError;
+
+  for (size_t i = 0; i < jobs.size(); i++) {
+    push(i % m_workers.size(), [&, i](Encoder& encoder) {
+      const EncodeJob& job = jobs[i];
+
+      std::exception_ptr error;
+      try {
+        if (job.writer) encoder.encode(job.data, job.params, *job.writer);
+        else encoder.encode(job.data, job.params);
+      } catch (...) {
+        error = std::current_exception();
+      }
+
+      if (onComplete) {
+        onComplete(i, error);
+      } else if (error) {
+        std::lock_guard lock(errorMutex);
+        if (!firstError) firstError = error;
+      }
+      done.count_down();
+    });
+  }
+
+  done.wait();
+  if (firstError) std::rethrow_exception(firstError);
+}
+
+std::future<void> EncoderPool::submit(const EncodeJob& job) {
+  auto promise = std::make_shared<std::promise<void>>();
+  std::future<void> future = promise->get_future();
+
+  size_t queue;
+  {
+    std::lock_guard lock(m_mutex);
+    queue = m_nextQueue++ % m_workers.size();
+  }
+
+  push(queue, [job, promise](Encoder& encoder) {
+    try {
+      if (job.writer) encoder.encode(job.data, job.params, *job.writer);
+      else encoder.encode(job.data, job.params);
+      promise->set_value();
+    } catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+  });
+
+  return future;
+}
+
+/*
+ * Size of an MCU in pixels, as set up by Encoder::start
+ */
+static std::pair<uint32_t, uint32_t> mcu_size(const EncodeParams& params) {
+  const auto [hSamp, vSamp] = luma_sampling(params);
+  return {uint32_t(hSamp) * DCTSIZE, uint32_t(vSamp) * DCTSIZE};
+}
+
+/*
+ * Locates the frame header and the start of entropy-coded data in a baseline
+ * JPEG written by libjpeg
+ */
+static void find_scan(const std::vector<uint8_t>& jpeg, size_t& frameHeader, size_t& scanData) {
+  size_t pos = 2; // Skip SOI
+  frameHeader = 0;
+
+  while (pos + 4 <= jpeg.size()) {
+    if (jpeg[pos] != 0xFF) break;
+
+    const uint8_t marker = jpeg[pos + 1];
+    const size_t length = (size_t(jpeg[pos + 2]) << 8) | jpeg[pos + 3];
+    if (marker == 0xC0 || marker == 0xC1) frameHeader = pos;
+    if (marker == 0xDA) {
+      scanData = pos + 2 + length;
+      if (frameHeader != 0 && scanData + 2 <= jpeg.size()) return;
+      break;
+    }
+
+    pos += 2 + length;
+  }
+
+  throw Error("Unexpected JPEG stream layout when joining bands");
+}
+
+void EncoderPool::encodeParallel(void* data, const EncodeParams& params, Writer& writer) {
+  const auto [mcuWidth, mcuHeight] = mcu_size(params);
+  const uint32_t mcusPerRow = (params.width + mcuWidth - 1) / mcuWidth;
+  const uint32_t mcuRows = (params.height + mcuHeight - 1) / mcuHeight;
+
+  /*
+   * Aim for a few bands per worker so work stealing can even out the load,
+   * keeping each band within the 16-bit restart interval
+   */
+  constexpr uint32_t maxRestartInterval = 65535;
+  const uint32_t maxBandMcuRows = mcusPerRow > 0 ? maxRestartInterval / mcusPerRow : 0;
+  const uint32_t targetBands = uint32_t(m_workers.size()) * 4;
+  const uint32_t bandMcuRows = std::min((mcuRows + targetBands - 1) / targetBands, maxBandMcuRows);
+
+  // Optimized and progressive encodes can't be split, each band would get its own tables, nor can
+  // encodes to a target size, whose bands would each pick their own quality
+  const bool splittable = !params.compression.optimizeHuffman && !params.compression.progressive
+                          && !params.compression.targetBytes;
+
+  if (!splittable || bandMcuRows == 0 || bandMcuRows >= mcuRows) {
+    submit({data, params, &writer}).get();
+    return;
+  }
+
+  const uint32_t bandHeight = bandMcuRows * mcuHeight;
+  const uint32_t nBands = (params.height + bandHeight - 1) / bandHeight;
+
+  /*
+   * Encode each band as a standalone JPEG with identical tables
+   */
+  std::vector<MemoryWriter> bands(nBands);
+  std::latch done(nBands);
+  std::mutex errorMutex;
+  std::exception_ptr firstError;
+
+  for (uint32_t i = 0; i < nBands; i++) {
+    push(i % m_workers.size(), [&, i](Encoder& encoder) {
+      try {
+        EncodeParams bandParams = params;
+        bandParams.stats = nullptr;
+        bandParams.inRowOffset = params.inRowOffset + i * bandHeight;
+        bandParams.height = std::min(bandHeight, params.height - i * bandHeight);
+        // The grid covers the whole image, not just the band
+        if (params.tiling.width) bandParams.tiling.gridStride = tile_grid_stride(params);
 
-#include <resource/icc/srgb.h>
-#include <resource/icc/display_p3.h>
+        encoder.encode(data, bandParams, bands[i], {
+          .restartInterval = mcusPerRow * bandMcuRows,
+          .embedProfile = i == 0,
+        });
+      } catch (...) {
+        std::lock_guard lock(errorMutex);
+        if (!firstError) firstError = std::current_exception();
+      }
+      done.count_down();
+    });
+  }
+
+  done.wait();
+  if (firstError) std::rethrow_exception(firstError);
 
+  /*
+   * Stitch the bands together: the first band's headers, with the frame height
+   * patched to the full image, followed by the entropy-coded data of each band
+   * separated by restart markers
+   */
+  std::vector<uint8_t> header = bands[0].buffer();
+  size_t frameHeader, scanData;
+  find_scan(header, frameHeader, scanData);
+  header[frameHeader + 5] = uint8_t(params.height >> 8);
+  header[frameHeader + 6] = uint8_t(params.height);
+
+  writer.write(header.data(), header.size() - 2);
+  for (uint32_t i = 1; i < nBands; i++) {
+    const uint8_t restart[2] = {0xFF, uint8_t(JPEG_RST0 + (i - 1) % 8)};
+    writer.write(restart, sizeof(restart));
+
+    const std::vector<uint8_t>& band = bands[i].buffer();
+    find_scan(band, frameHeader, scanData);
+    writer.write(band.data() + scanData, band.size() - scanData - 2);
+  }
+
+  const uint8_t end[2] = {0xFF, JPEG_EOI};
+  writer.write(end, sizeof(end));
+  writer.flush();
 }
 
-// IEEE-754 half-precision float to 32-bit float conversion
-// https://stackoverflow.com/a/60047308
-template<typename T, typename U>
-static T as(const U x) { return *(T*) &x; }
+void EncoderPool::encodeParallel(void* data, const EncodeParams& params) {
+  FileWriter writer(params.outPath);
+  encodeParallel(data, params, writer);
+}
 
-static float half_to_float(const uint16_t x) { // IEEE-754 16-bit floating-point format (without infinity): 1-5-10, exp-15, +-131008.0, +-6.1035156E-5, +-5.9604645E-8, 3.311 digits
-  const uint32_t e = (x & 0x7C00) >> 10; // exponent
-  const uint32_t m = (x & 0x03FF) << 13; // mantissa
-  const uint32_t v = as<uint16_t>((float) m) >> 23; // evil log2 bit hack to count leading zeros in denormalized format
-  return as<float>((x & 0x8000) << 16
-                   | (e != 0) * ((e + 112) << 23 | m)
-                   | ((e == 0) & (m != 0)) *
-                     ((v - 37) << 23 | ((m << (150 - v)) & 0x007FE000))); // sign : normalized : denormalized
+/*
+ * Rows of one level of a pyramid
+ * Rows are appended as they're produced, and dropped from the top once the
+ * level's tiles and the next level down no longer need them.
+ */
+struct PyramidLevel {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  size_t rowBytes = 0;
+
+  std::vector<uint8_t> rows;
+  // First row held, and number of rows produced so far
+  uint32_t firstRow = 0;
+  uint32_t rowsDone = 0;
+  // Next row of tiles to encode
+  uint32_t tileRow = 0;
+
+  uint8_t* row(uint32_t y) { return rows.data() + rowBytes * (y - firstRow); }
+
+  // Makes room for the rows up to end
+  void reserve(uint32_t end) {
+    const size_t size = rowBytes * (end - firstRow);
+    if (rows.size() < size) rows.resize(size);
+  }
+
+  // Drops the rows above begin
+  void drop(uint32_t begin) {
+    if (begin <= firstRow) return;
+    std::memmove(rows.data(), row(begin), rowBytes * (rowsDone - begin));
+    firstRow = begin;
+  }
+};
+
+/*
+ * Sizes of the levels of a pyramid, from a single pixel up to full resolution
+ * Each level is half the size of the next, rounded up.
+ */
+static std::vector<std::pair<uint32_t, uint32_t>> pyramid_levels(uint32_t width, uint32_t height) {
+  std::vector<std::pair<uint32_t, uint32_t>> levels = {{width, height}};
+  while (width > 1 || height > 1) {
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+    levels.emplace_back(width, height);
+  }
+
+  std::reverse(levels.begin(), levels.end());
+  return levels;
 }
 
-Encoder::Encoder() noexcept {
-  m_cinfo.err = jpeg_std_error(&m_jerr);
-  jpeg_create_compress(&m_cinfo);
+/*
+ * Halves a pair of rows of 8bpc pixels with a 2x2 box filter
+ * The last column of an odd-width level is averaged with itself.
+ */
+template<uint32_t Components>
+static void downsample_row(const uint8_t* top, const uint8_t* bottom, uint8_t* dst, uint32_t srcWidth) {
+  const uint32_t pairs = srcWidth / 2;
+  for (uint32_t x = 0; x < pairs; x++) {
+    const uint8_t* a = top + x * 2 * Components;
+    const uint8_t* b = bottom + x * 2 * Components;
+    for (uint32_t c = 0; c < Components; c++) {
+      dst[x * Components + c] = uint8_t((a[c] + a[c + Components] + b[c] + b[c + Components] + 2) >> 2);
+    }
+  }
+
+  if (srcWidth % 2) {
+    const uint8_t* a = top + pairs * 2 * Components;
+    const uint8_t* b = bottom + pairs * 2 * Components;
+    for (uint32_t c = 0; c < Components; c++) {
+      dst[pairs * Components + c] = uint8_t((a[c] + b[c] + 1) >> 1);
+    }
+  }
 }
 
-Encoder::~Encoder() {
-  jpeg_destroy_compress(&m_cinfo);
+void EncoderPool::encodePyramid(void* data, const EncodeParams& params, const PyramidParams& pyramid, const TileCallback& onTile) {
+  if (is_ycbcr(params.colorMode) || params.planes[0].data || params.tiling.width) {
+    throw Error("Pyramid input must be interleaved RGB or grayscale");
+  }
+  if (params.width == 0 || params.height == 0) throw Error("Pyramid input must not be empty");
+  if (pyramid.tileSize == 0) throw Error("Pyramid tiles must be at least one pixel");
+  check_conversion(params);
+
+  const uint32_t tileSize = pyramid.tileSize;
+  const uint32_t overlap = pyramid.overlap;
+  const uint32_t components = params.colorMode == ColorMode::Grayscale ? 1 : 3;
+  const auto downsample = components == 1 ? downsample_row<1> : downsample_row<3>;
+
+  /*
+   * Full resolution rows are converted to 8bpc like any other input
+   */
+  const RowLayout layout = input_layout(params, components, false);
+  const RowConverter convertRow = select_row_converter(params.pixelFormat, layout);
+  const size_t rowStride = params.inRowStride == -1 ? size_t(layout.pixelStride) * params.width : params.inRowStride;
+  const uint8_t* input = static_cast<const uint8_t*>(data)
+                         + rowStride * params.inRowOffset
+                         + size_t(layout.pixelStride) * params.inPixelOffset
+                         + size_t(layout.channelStride) * params.inChannelOffset;
+
+  std::vector<PyramidLevel> levels;
+  for (const auto& [width, height]: pyramid_levels(params.width, params.height)) {
+    PyramidLevel& level = levels.emplace_back();
+    level.width = width;
+    level.height = height;
+    level.rowBytes = size_t(width) * components;
+  }
+
+  // Tiles are encoded from the level's rows, which are already packed 8bpc pixels
+  EncodeParams tileParams = params;
+  tileParams.pixelFormat = PixelFormat::Uint8;
+  tileParams.toneCurve = nullptr;
+  tileParams.linearInput.reset();
+  tileParams.inChannels = -1;
+  tileParams.inChannelOffset = 0;
+  tileParams.inPixelStride = -1;
+  tileParams.inRowOffset = 0;
+  tileParams.planes = {};
+  tileParams.tiling = {};
+  tileParams.stats = nullptr;
+  std::vector<MemoryWriter> tileBuffers(m_workers.size());
+
+  struct Tile {
+    uint32_t level;
+    uint32_t column;
+    uint32_t row;
+  };
+  std::vector<Tile> tiles;
+
+  /*
+   * Rows of a tile, and columns likewise, including the overlap
+   */
+  const auto tile_begin = [&](uint32_t i) { return i == 0 ? 0 : i * tileSize - std::min(overlap, i * tileSize); };
+  const auto tile_end = [&](uint32_t i, uint32_t size) {
+    return uint32_t(std::min<uint64_t>(uint64_t(i + 1) * tileSize + overlap, size));
+  };
+
+  const auto encode_tile = [&](const Tile& tile, Encoder& encoder) {
+    PyramidLevel& level = levels[tile.level];
+    const uint32_t x = tile_begin(tile.column);
+    const uint32_t y = tile_begin(tile.row);
+
+    EncodeParams tp = tileParams;
+    tp.width = tile_end(tile.column, level.width) - x;
+    tp.height = tile_end(tile.row, level.height) - y;
+    tp.inPixelOffset = x;
+    tp.inRowStride = int32_t(level.rowBytes);
+
+    MemoryWriter& buffer = tileBuffers[&encoder - m_encoders.data()];
+    buffer.clear();
+    encoder.encode(level.row(y), tp, buffer, {.embedProfile = pyramid.embedProfile});
+    onTile({tile.level, tile.column, tile.row, tp.width, tp.height}, {buffer.data(), buffer.size()});
+  };
+
+  PyramidLevel& top = levels.back();
+  while (top.rowsDone < top.height) {
+    /*
+     * Convert the rows completing the next row of full resolution tiles, in
+     * one chunk per worker
+     */
+    const uint32_t begin = top.rowsDone;
+    const uint32_t end = tile_end(top.tileRow, top.height);
+    const uint32_t chunkRows = uint32_t((end - begin + m_workers.size() - 1) / m_workers.size());
+    top.reserve(end);
+
+    parallelFor((end - begin + chunkRows - 1) / chunkRows, [&](size_t i, Encoder&) {
+      const uint32_t chunkEnd = std::min(end, begin + uint32_t(i + 1) * chunkRows);
+      for (uint32_t y = begin + uint32_t(i) * chunkRows; y < chunkEnd; y++) {
+        convertRow(input + rowStride * y, top.row(y), params.width, layout);
+      }
+    });
+    top.rowsDone = end;
+
+    /*
+     * Work down the levels, encoding every row of tiles whose rows are all
+     * available while halving the new rows into the level below
+     */
+    for (size_t iLevel = levels.size(); iLevel-- > 0;) {
+      PyramidLevel& level = levels[iLevel];
+      PyramidLevel* next = iLevel > 0 ? &levels[iLevel - 1] : nullptr;
+
+      tiles.clear();
+      const uint32_t tileRows = (level.height + tileSize - 1) / tileSize;
+      const uint32_t tileColumns = (level.width + tileSize - 1) / tileSize;
+      uint32_t tileRow = level.tileRow;
+      for (; tileRow < tileRows && tile_end(tileRow, level.height) <= level.rowsDone; tileRow++) {
+        for (uint32_t column = 0; column < tileColumns; column++) tiles.push_back({uint32_t(iLevel), column, tileRow});
+      }
+
+      // Each row below is made from two rows of this level, the last one of an odd-height level from one
+      const uint32_t nextBegin = next ? next->rowsDone : 0;
+      const uint32_t nextEnd = !next ? 0 : level.rowsDone == level.height ? next->height : level.rowsDone / 2;
+      if (tiles.empty() && nextBegin == nextEnd) break;
+
+      const uint32_t nChunks = next ? std::min<uint32_t>(nextEnd - nextBegin, uint32_t(m_workers.size())) : 0;
+      const uint32_t chunkRows = nChunks ? (nextEnd - nextBegin + nChunks - 1) / nChunks : 0;
+      if (next) next->reserve(nextEnd);
+
+      parallelFor(tiles.size() + nChunks, [&](size_t i, Encoder& encoder) {
+        if (i < tiles.size()) {
+          encode_tile(tiles[i], encoder);
+          return;
+        }
+
+        const uint32_t chunk = uint32_t(i - tiles.size());
+        const uint32_t chunkEnd = std::min(nextEnd, nextBegin + (chunk + 1) * chunkRows);
+        for (uint32_t y = nextBegin + chunk * chunkRows; y < chunkEnd; y++) {
+          const uint8_t* bottom = level.row(std::min(y * 2 + 1, level.height - 1));
+          downsample(level.row(y * 2), bottom, next->row(y), level.width);
+        }
+      });
+
+      level.tileRow = tileRow;
+      if (next) next->rowsDone = nextEnd;
+
+      // Keep the rows the next tiles and the next level's rows still need
+      uint32_t keep = tileRow < tileRows ? tile_begin(tileRow) : level.rowsDone;
+      if (next) keep = std::min(keep, next->rowsDone * 2);
+      level.drop(std::min(keep, level.rowsDone));
+    }
+  }
+}
+
+void EncoderPool::encodePyramid(void* data, const EncodeParams& params, const PyramidParams& pyramid) {
+  const fs::path& descriptor = params.outPath;
+  const fs::path tileDirectory = descriptor.parent_path() / (descriptor.stem().string() + "_files");
+
+  // Level directories are created up front, so workers only create files
+  const size_t nLevels = pyramid_levels(params.width, params.height).size();
+  for (size_t iLevel = 0; iLevel < nLevels; iLevel++) fs::create_directories(tileDirectory / std::to_string(iLevel));
+
+  encodePyramid(data, params, pyramid, [&](const PyramidTile& tile, std::span<const uint8_t> jpeg) {
+    const std::string name = std::to_string(tile.column) + "_" + std::to_string(tile.row) + ".jpeg";
+    FileWriter writer(tileDirectory / std::to_string(tile.level) / name);
+    writer.write(jpeg.data(), jpeg.size());
+    writer.flush();
+  });
+
+  const std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                          "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"jpeg\""
+                          " Overlap=\"" + std::to_string(pyramid.overlap)
+                          + "\" TileSize=\"" + std::to_string(pyramid.tileSize) + "\">\n"
+                          "  <Size Width=\"" + std::to_string(params.width)
+                          + "\" Height=\"" + std::to_string(params.height) + "\"/>\n"
+                          "</Image>\n";
+  FileWriter writer(descriptor);
+  writer.write(reinterpret_cast<const uint8_t*>(xml.data()), xml.size());
+  writer.flush();
 }
 
-Encoder::Encoder(Encoder&& enc) noexcept {
-  m_cinfo = enc.m_cinfo;
-  m_jerr = enc.m_jerr;
+void EncoderPool::setTraceCallback(const TraceCallback& callback) {
+  for (Encoder& encoder: m_encoders) encoder.setTraceCallback(callback);
 }
 
-Encoder& Encoder::operator=(Encoder&& enc) noexcept {
-  m_cinfo = enc.m_cinfo;
-  m_jerr = enc.m_jerr;
+/*
+ * Runs body for every index on the workers, blocking until all of them have
+ * finished, and rethrows the first failure
+ */
+void EncoderPool::parallelFor(size_t count, const std::function<void(size_t index, Encoder& encoder)>& body) {
+  std::latch done(static_cast<ptrdiff_t>(count));
+  std::mutex errorMutex;
+  std::exception_ptr firstError;
+
+  for (size_t i = 0; i < count; i++) {
+    push(i % m_workers.size(), [&, i](Encoder& encoder) {
+      try {
+        body(i, encoder);
+      } catch (...) {
+        std::lock_guard lock(errorMutex);
+        if (!firstError) firstError = std::current_exception();
+      }
+      done.count_down();
+    });
+  }
+
+  done.wait();
+  if (firstError) std::rethrow_exception(firstError);
+}
+
+void EncoderPool::push(size_t queue, Task task) {
+  {
+    // Counted under the queue's lock, so the count always matches the queues
+    std::lock_guard lock(m_workers[queue]->mutex);
+    m_workers[queue]->tasks.push_back(std::move(task));
+    m_pending++;
+  }
+  // A worker that saw no tasks is either still holding the lock or already waiting, so it can't miss this
+  { std::lock_guard lock(m_mutex); }
+  m_wake.notify_one();
+}
+
+bool EncoderPool::pop(size_t worker, Task& task) {
+  // Try our own queue first, then steal from the others
+  for (size_t i = 0; i < m_workers.size(); i++) {
+    Worker& victim = *m_workers[(worker + i) % m_workers.size()];
+
+    std::lock_guard lock(victim.mutex);
+    if (victim.tasks.empty()) continue;
+
+    if (i == 0) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+    } else {
+      task = std::move(victim.tasks.back());
+      victim.tasks.pop_back();
+    }
+    m_pending--;
+    return true;
+  }
+
+  return false;
+}
+
+void EncoderPool::run(size_t worker) {
+  Task task;
+  while (true) {
+    {
+      std::unique_lock lock(m_mutex);
+      m_wake.wait(lock, [this] { return m_pending > 0 || m_stopping; });
+      if (m_pending == 0 && m_stopping) return;
+    }
+
+    // Fails only when another worker took the task first, or a new one went to a queue already searched
+    if (!pop(worker, task)) continue;
+
+    task(m_encoders[worker]);
+    task = nullptr;
+  }
+}
+
+/*
+ * Decoder
+ */
+
+/*
+ * Input for the decompression object, reading either straight from memory or
+ * through a buffer from a file
+ */
+struct Decoder::Source : jpeg_source_mgr {
+  static constexpr size_t bufferSize = 64 * 1024;
+  static constexpr JOCTET eoi[2] = {0xFF, JPEG_EOI};
+
+  FILE* file = nullptr;
+  // Only allocated once a file is read
+  std::vector<uint8_t> buffer;
+
+  Source() : jpeg_source_mgr() {
+    init_source = init;
+    fill_input_buffer = fill;
+    skip_input_data = skip;
+    resync_to_restart = jpeg_resync_to_restart;
+    term_source = term;
+  }
+
+  static Source& from(j_decompress_ptr cinfo) {
+    return *static_cast<Source*>(cinfo->src);
+  }
+
+  void setMemory(std::span<const uint8_t> data) {
+    file = nullptr;
+    next_input_byte = data.data();
+    bytes_in_buffer = data.size();
+  }
+
+  void setFile(FILE* input) {
+    file = input;
+    if (buffer.empty()) buffer.resize(bufferSize);
+    next_input_byte = buffer.data();
+    bytes_in_buffer = 0;
+  }
+
+  static void init(j_decompress_ptr) {}
+
+  static boolean fill(j_decompress_ptr cinfo) {
+    Source& src = from(cinfo);
+    const size_t size = src.file ? std::fread(src.buffer.data(), 1, src.buffer.size(), src.file) : 0;
+
+    if (size == 0) {
+      if (src.file && std::ferror(src.file)) throw std::system_error(errno, std::generic_category(), "fread");
+
+      // Truncated data: insert a fake EOI marker, like libjpeg's own sources
+      WARNMS(cinfo, JWRN_JPEG_EOF);
+      src.next_input_byte = eoi;
+      src.bytes_in_buffer = sizeof(eoi);
+      return TRUE;
+    }
+
+    src.next_input_byte = src.buffer.data();
+    src.bytes_in_buffer = size;
+    return TRUE;
+  }
+
+  static void skip(j_decompress_ptr cinfo, long size) {
+    Source& src = from(cinfo);
+    if (size <= 0) return;
+
+    while (size_t(size) > src.bytes_in_buffer) {
+      size -= long(src.bytes_in_buffer);
+      fill(cinfo);
+    }
+    src.next_input_byte += size;
+    src.bytes_in_buffer -= size_t(size);
+  }
+
+  static void term(j_decompress_ptr) {}
+};
+
+Decoder::Decoder() noexcept
+  : m_dinfo(std::make_unique<jpeg_decompress_struct>()),
+    m_jerr(std::make_unique<jpeg_error_mgr>()),
+    m_source(std::make_unique<Source>()) {
+  m_dinfo->err = jpeg_std_error(m_jerr.get());
+  m_jerr->error_exit = error_exit;
+  jpeg_create_decompress(m_dinfo.get());
+}
+
+Decoder::~Decoder() {
+  if (m_dinfo) jpeg_destroy_decompress(m_dinfo.get());
+}
+
+Decoder::Decoder(Decoder&& dec) noexcept
+  : m_dinfo(std::move(dec.m_dinfo)),
+    m_jerr(std::move(dec.m_jerr)),
+    m_source(std::move(dec.m_source)),
+    m_stripBuffer(std::move(dec.m_stripBuffer)),
+    m_stripRows(std::move(dec.m_stripRows)) {}
+
+Decoder& Decoder::operator=(Decoder&& dec) noexcept {
+  if (this == &dec) return *this;
+
+  if (m_dinfo) jpeg_destroy_decompress(m_dinfo.get());
+  m_dinfo = std::move(dec.m_dinfo);
+  m_jerr = std::move(dec.m_jerr);
+  m_source = std::move(dec.m_source);
+  m_stripBuffer = std::move(dec.m_stripBuffer);
+  m_stripRows = std::move(dec.m_stripRows);
 
   return *this;
 }
 
-void Encoder::encode(void* data, const EncodeParams& params) {
-  // Set up a simple buffer
-  // TODO use a writer object
-  unsigned char* buf = nullptr;
-  unsigned long size = 0;
-  jpeg_mem_dest(&m_cinfo, &buf, &size);
+ImageInfo Decoder::readInfo(std::span<const uint8_t> jpeg, const DecodeParams& params) {
+  m_source->setMemory(jpeg);
 
-  /*
-   * Configure the compression object with image parameters
-   */
-  m_cinfo.image_width = params.width;
-  m_cinfo.image_height = params.height;
+  try {
+    ImageInfo info = start(params);
+    jpeg_abort_decompress(m_dinfo.get());
+    return info;
+  } catch (...) {
+    jpeg_abort_decompress(m_dinfo.get());
+    throw;
+  }
+}
 
-  switch (params.colorMode) {
-    case ColorMode::RGB: {
-      m_cinfo.input_components = 3;
-      m_cinfo.in_color_space = JCS_RGB;
-      break;
+ImageInfo Decoder::readInfo(const fs::path& path, const DecodeParams& params) {
+  auto file = open_input(path);
+  m_source->setFile(file.get());
+
+  try {
+    ImageInfo info = start(params);
+    jpeg_abort_decompress(m_dinfo.get());
+    return info;
+  } catch (...) {
+    jpeg_abort_decompress(m_dinfo.get());
+    throw;
+  }
+}
+
+ImageInfo Decoder::decode(std::span<const uint8_t> jpeg, void* out, const DecodeParams& params) {
+  m_source->setMemory(jpeg);
+  return decode(out, nullptr, params);
+}
+
+ImageInfo Decoder::decode(const fs::path& path, void* out, const DecodeParams& params) {
+  auto file = open_input(path);
+  m_source->setFile(file.get());
+  return decode(out, nullptr, params);
+}
+
+ImageInfo Decoder::decode(std::span<const uint8_t> jpeg, std::vector<uint8_t>& out, const DecodeParams& params) {
+  m_source->setMemory(jpeg);
+  return decode(nullptr, &out, params);
+}
+
+ImageInfo Decoder::decode(const fs::path& path, std::vector<uint8_t>& out, const DecodeParams& params) {
+  auto file = open_input(path);
+  m_source->setFile(file.get());
+  return decode(nullptr, &out, params);
+}
+
+/*
+ * Reads the header and configures decompression, leaving the object ready for
+ * jpeg_start_decompress
+ */
+ImageInfo Decoder::start(const DecodeParams& params) {
+  m_dinfo->src = m_source.get();
+
+  if (params.colorMode != ColorMode::RGB && params.colorMode != ColorMode::Grayscale) {
+    throw Error("Only RGB and grayscale output is supported when decoding");
+  }
+
+  // The ICC profile is stored in APP2 markers, which are only kept if asked for
+  jpeg_save_markers(m_dinfo.get(), JPEG_APP0 + 2, params.iccProfile ? 0xFFFF : 0);
+  jpeg_read_header(m_dinfo.get(), true);
+
+  m_dinfo->out_color_space = params.colorMode == ColorMode::RGB ? JCS_RGB : JCS_GRAYSCALE;
+  m_dinfo->scale_num = params.scaleNum;
+  m_dinfo->scale_denom = params.scaleDenom;
+  switch (params.dctMethod) {
+    case DctMethod::Integer: m_dinfo->dct_method = JDCT_ISLOW; break;
+    case DctMethod::IntegerFast: m_dinfo->dct_method = JDCT_IFAST; break;
+    case DctMethod::Float: m_dinfo->dct_method = JDCT_FLOAT; break;
+  }
+  m_dinfo->do_fancy_upsampling = params.fancyUpsampling;
+  jpeg_calc_output_dimensions(m_dinfo.get());
+
+  if (params.iccProfile) {
+    params.iccProfile->clear();
+
+    JOCTET* profile = nullptr;
+    unsigned int profileSize = 0;
+    if (jpeg_read_icc_profile(m_dinfo.get(), &profile, &profileSize)) {
+      params.iccProfile->assign(profile, profile + profileSize);
+      std::free(profile);
     }
-    case ColorMode::Grayscale: {
-      m_cinfo.input_components = 1;
-      m_cinfo.in_color_space = JCS_GRAYSCALE;
-      break;
+  }
+
+  return {
+    .width = m_dinfo->output_width,
+    .height = m_dinfo->output_height,
+    .jpegWidth = m_dinfo->image_width,
+    .jpegHeight = m_dinfo->image_height,
+    .jpegComponents = uint32_t(m_dinfo->num_components),
+    .progressive = bool(m_dinfo->progressive_mode),
+  };
+}
+
+ImageInfo Decoder::decode(void* out, std::vector<uint8_t>* outVector, const DecodeParams& params) {
+  try {
+    ImageInfo info = start(params);
+    jpeg_start_decompress(m_dinfo.get());
+
+    /*
+     * Calculate the output layout
+     */
+    const uint32_t components = m_dinfo->output_components;
+    const uint32_t nChannels = params.outChannels == -1 ? components : params.outChannels;
+    const uint32_t channelStride = params.channelStride();
+    const uint32_t pixelStride = params.outPixelStride == -1
+                                 ? channelStride * nChannels
+                                 : params.outPixelStride;
+    const size_t rowStride = params.outRowStride == -1
+                             ? size_t(pixelStride) * info.width
+                             : params.outRowStride;
+
+    if (outVector) {
+      outVector->resize(
+        rowStride * (params.outRowOffset + info.height - 1) + size_t(pixelStride) * (params.outPixelOffset + info.width)
+      );
+      out = outVector->data();
+    }
+
+    uint8_t* firstRow = static_cast<uint8_t*>(out)
+                        + rowStride * params.outRowOffset
+                        + size_t(pixelStride) * params.outPixelOffset
+                        + size_t(channelStride) * params.outChannelOffset;
+
+    const RowLayout layout = {
+      .inChannels = nChannels,
+      .components = components,
+      .channelStride = channelStride,
+      .pixelStride = pixelStride,
+    };
+    const RowConverter storeRow = select_store_row(params.pixelFormat, layout);
+    // Packed 8bpc output is decoded straight into the output buffer
+    const bool zeroCopy = is_zero_copy(params.pixelFormat, layout);
+
+    /*
+     * Read rows in strips, converting each strip while it's in cache
+     */
+    const uint32_t stripHeight = std::max(m_dinfo->rec_outbuf_height, 2 * DCTSIZE);
+    const size_t rowBytes = size_t(components) * info.width;
+    m_stripBuffer.resize(zeroCopy ? 0 : rowBytes * stripHeight);
+    m_stripRows.resize(stripHeight);
+
+    while (m_dinfo->output_scanline < m_dinfo->output_height) {
+      const uint32_t firstScanline = m_dinfo->output_scanline;
+      const uint32_t nRows = std::min(stripHeight, m_dinfo->output_height - firstScanline);
+
+      for (uint32_t iRow = 0; iRow < nRows; iRow++) {
+        m_stripRows[iRow] = zeroCopy
+                            ? firstRow + rowStride * (firstScanline + iRow)
+                            : m_stripBuffer.data() + rowBytes * iRow;
+      }
+
+      const uint32_t rowsRead = jpeg_read_scanlines(m_dinfo.get(), m_stripRows.data(), nRows);
+      if (!zeroCopy) {
+        for (uint32_t iRow = 0; iRow < rowsRead; iRow++) {
+          storeRow(m_stripRows[iRow], firstRow + rowStride * (firstScanline + iRow), info.width, layout);
+        }
+      }
     }
+
+    jpeg_finish_decompress(m_dinfo.get());
+    return info;
+  } catch (...) {
+    // Leave the decompression object ready for the next image
+    jpeg_abort_decompress(m_dinfo.get());
+    throw;
   }
+}
 
-  /*
-   * Set default settings for libjpeg. This needs to be done *after* setting the
-   * color mode ("colorspace" in libjpeg terms).
-   */
-  jpeg_set_defaults(&m_cinfo);
+/*
+ * Transformer
+ */
 
-  /*
-   * Calculate parameters
-   */
-  uint32_t nChannels = params.inChannels == -1
-                       ? m_cinfo.input_components
-                       : params.inChannels;
-  uint32_t channelStride = params.channelStride();
-  uint32_t pixelStride = params.inPixelStride == -1
-                         ? channelStride * nChannels
-                         : params.inPixelStride;
-  uint32_t rowStride = params.inRowStride == -1
-                       ? pixelStride * params.width
-                       : params.inRowStride;
+/*
+ * How a transform moves blocks and coefficients
+ * Transposing transforms swap the axes first; the flips then apply to the
+ * output. mirrorX/mirrorY are the source axes that end up reversed.
+ */
+struct TransformOps {
+  bool transpose;
+  bool mirrorX;
+  bool mirrorY;
 
-  /*
-   * Initialize compression op
-   */
-  jpeg_start_compress(&m_cinfo, true);
+  // Signs of the output coefficients
+  std::array<JCOEF, DCTSIZE2> sign;
+};
 
-  /*
-   * Embed ICC profile data
-   */
-  switch (params.colorSpace) {
-    case ColorSpace::sRGB: {
-      jpeg_write_icc_profile(
-        &m_cinfo,
-        reinterpret_cast<const JOCTET*>(&icc_data::sRGB2014_icc),
-        icc_data::sRGB2014_icc_len
+static TransformOps transform_ops(Transform transform) {
+  TransformOps ops{};
+  // Negate coefficients with odd horizontal / vertical frequency in the output
+  bool negateU = false, negateV = false;
+  switch (transform) {
+    case Transform::None: break;
+    case Transform::FlipHorizontal: ops.mirrorX = negateU = true; break;
+    case Transform::FlipVertical: ops.mirrorY = negateV = true; break;
+    case Transform::Transpose: ops.transpose = true; break;
+    case Transform::Transverse: ops.transpose = ops.mirrorX = ops.mirrorY = negateU = negateV = true; break;
+    case Transform::Rotate90: ops.transpose = ops.mirrorY = negateU = true; break;
+    case Transform::Rotate180: ops.mirrorX = ops.mirrorY = negateU = negateV = true; break;
+    case Transform::Rotate270: ops.transpose = ops.mirrorX = negateV = true; break;
+  }
+
+  for (uint32_t v = 0; v < DCTSIZE; v++) {
+    for (uint32_t u = 0; u < DCTSIZE; u++) {
+      ops.sign[v * DCTSIZE + u] = (negateU && (u & 1)) != (negateV && (v & 1)) ? -1 : 1;
+    }
+  }
+  return ops;
+}
+
+template<bool Transpose>
+static void transform_block(const JCOEF* src, JCOEF* dst, const TransformOps& ops) {
+  for (uint32_t v = 0; v < DCTSIZE; v++) {
+    for (uint32_t u = 0; u < DCTSIZE; u++) {
+      const JCOEF coef = Transpose ? src[u * DCTSIZE + v] : src[v * DCTSIZE + u];
+      dst[v * DCTSIZE + u] = JCOEF(coef * ops.sign[v * DCTSIZE + u]);
+    }
+  }
+}
+
+/*
+ * Copies the blocks of one component from the source region starting at block
+ * (x0, y0), which is srcWidth x srcHeight blocks, into the output array
+ */
+static void transform_component(
+  j_decompress_ptr dinfo, jvirt_barray_ptr src, j_compress_ptr cinfo, jvirt_barray_ptr dst,
+  const jpeg_component_info& comp, uint32_t x0, uint32_t y0, uint32_t srcWidth, uint32_t srcHeight,
+  const TransformOps& ops
+) {
+  const uint32_t outWidth = ops.transpose ? srcHeight : srcWidth;
+  const uint32_t outHeight = ops.transpose ? srcWidth : srcHeight;
+  const uint32_t hSamp = comp.h_samp_factor;
+  const uint32_t vSamp = comp.v_samp_factor;
+
+  // Source blocks, in coordinates relative to the region
+  const auto srcColumn = [&](uint32_t x) { return x0 + (ops.mirrorX ? srcWidth - 1 - x : x); };
+
+  // Arrays are accessed a row of iMCUs at a time
+  for (uint32_t outRow = 0; outRow < outHeight; outRow += vSamp) {
+    JBLOCKARRAY dstRows = (*cinfo->mem->access_virt_barray)(
+      reinterpret_cast<j_common_ptr>(cinfo), dst, outRow, vSamp, TRUE
+    );
+
+    if (!ops.transpose) {
+      const uint32_t srcRow = y0 + (ops.mirrorY ? srcHeight - outRow - vSamp : outRow);
+      JBLOCKARRAY srcRows = (*dinfo->mem->access_virt_barray)(
+        reinterpret_cast<j_common_ptr>(dinfo), src, srcRow, vSamp, FALSE
       );
+
+      for (uint32_t iRow = 0; iRow < vSamp; iRow++) {
+        const JBLOCKROW srcBlocks = srcRows[ops.mirrorY ? vSamp - 1 - iRow : iRow];
+        for (uint32_t x = 0; x < outWidth; x++) {
+          transform_block<false>(srcBlocks[srcColumn(x)], dstRows[iRow][x], ops);
+        }
+      }
+      continue;
     }
-    case ColorSpace::DisplayP3: {
-      jpeg_write_icc_profile(
-        &m_cinfo,
-        reinterpret_cast<const JOCTET*>(&icc_data::Display_P3_icc),
-        icc_data::Display_P3_icc_len
+
+    // Output columns come from source rows, and output rows from source columns
+    for (uint32_t outColumn = 0; outColumn < outWidth; outColumn += hSamp) {
+      const uint32_t srcRow = y0 + (ops.mirrorY ? srcHeight - outColumn - hSamp : outColumn);
+      JBLOCKARRAY srcRows = (*dinfo->mem->access_virt_barray)(
+        reinterpret_cast<j_common_ptr>(dinfo), src, srcRow, hSamp, FALSE
       );
+
+      for (uint32_t iRow = 0; iRow < vSamp; iRow++) {
+        for (uint32_t iColumn = 0; iColumn < hSamp; iColumn++) {
+          const JBLOCKROW srcBlocks = srcRows[ops.mirrorY ? hSamp - 1 - iColumn : iColumn];
+          transform_block<true>(srcBlocks[srcColumn(outRow + iRow)], dstRows[iRow][outColumn + iColumn], ops);
+        }
+      }
     }
   }
+}
 
-  /*
-   * Write JPEG data
-   */
-  std::vector<uint8_t> rowBuffer(sizeof(uint8_t) * m_cinfo.input_components * params.width);
-  uint8_t* rowBufferRaw = rowBuffer.data();
+/*
+ * Copies the saved APPn and COM markers, except those libjpeg writes itself
+ */
+static void copy_markers(j_decompress_ptr dinfo, j_compress_ptr cinfo) {
+  for (jpeg_saved_marker_ptr marker = dinfo->marker_list; marker; marker = marker->next) {
+    const bool jfif = marker->marker == JPEG_APP0 && marker->data_length >= 5
+                      && std::memcmp(marker->data, "JFIF", 5) == 0;
+    const bool adobe = marker->marker == JPEG_APP0 + 14 && marker->data_length >= 5
+                       && std::memcmp(marker->data, "Adobe", 5) == 0;
+    if ((jfif && cinfo->write_JFIF_header) || (adobe && cinfo->write_Adobe_marker)) continue;
+
+    jpeg_write_marker(cinfo, marker->marker, marker->data, marker->data_length);
+  }
+}
+
+ImageInfo Transformer::transform(std::span<const uint8_t> jpeg, const TransformParams& params, Writer& writer) {
+  m_decoder.m_source->setMemory(jpeg);
+  return transform(params, writer);
+}
+
+ImageInfo Transformer::transform(const fs::path& path, const TransformParams& params, Writer& writer) {
+  auto file = open_input(path);
+  m_decoder.m_source->setFile(file.get());
+  return transform(params, writer);
+}
+
+ImageInfo Transformer::transform(
+  std::span<const uint8_t> jpeg, const TransformParams& params, std::vector<uint8_t>& out
+) {
+  out.clear();
+  VectorWriter writer(out);
+  return transform(jpeg, params, writer);
+}
+
+ImageInfo Transformer::transform(const fs::path& path, const TransformParams& params, std::vector<uint8_t>& out) {
+  out.clear();
+  VectorWriter writer(out);
+  return transform(path, params, writer);
+}
+
+ImageInfo Transformer::transform(const TransformParams& params, Writer& writer) {
+  j_decompress_ptr dinfo = m_decoder.m_dinfo.get();
+  j_compress_ptr cinfo = m_encoder.m_cinfo.get();
+
+  dinfo->src = m_decoder.m_source.get();
+  m_encoder.m_dest->writer = &writer;
+  m_encoder.m_dest->bytesWritten = 0;
+  cinfo->dest = m_encoder.m_dest.get();
+
+  try {
+    const int saveLength = params.copyMarkers ? 0xFFFF : 0;
+    jpeg_save_markers(dinfo, JPEG_COM, saveLength);
+    for (int iMarker = 0; iMarker < 16; iMarker++) jpeg_save_markers(dinfo, JPEG_APP0 + iMarker, saveLength);
+
+    jpeg_read_header(dinfo, TRUE);
+    jvirt_barray_ptr* srcArrays = jpeg_read_coefficients(dinfo);
 
-  while (m_cinfo.next_scanline < m_cinfo.image_height) {
     /*
-     * Copy a scanline's worth of data from the input buffer to the internal row
-     * buffer, adapting to the expected 8bpc integer format
+     * Work out the region to keep, in whole iMCUs at the top-left corner
      */
-    size_t scanlineOffset = rowStride * (m_cinfo.next_scanline + params.inRowOffset);
-    for (size_t iPixel = 0; iPixel < params.width; iPixel++) {
-      size_t pixelOffset = pixelStride * (iPixel + params.inPixelOffset);
-      for (size_t iChannel = 0; iChannel < m_cinfo.input_components; iChannel++) {
-        size_t channelOffset = channelStride * (iChannel + params.inChannelOffset);
-
-        size_t offset = scanlineOffset + pixelOffset + channelOffset;
-        size_t iWrite = iPixel * m_cinfo.input_components + iChannel;
-
-        uint8_t* dataPtr = ((uint8_t*) data) + offset;
-        switch (params.pixelFormat) {
-          case PixelFormat::Uint8: {
-            // This is the simplest operation: just copy the data per channel
-            rowBufferRaw[iWrite] = *dataPtr;
-            break;
-          }
-          case PixelFormat::Uint16: {
-            // For >8bit integer formats, simply dump the lower bits
-            // TODO: possibly add dithering support?
-            rowBufferRaw[iWrite] = uint8_t(*((uint16_t*) dataPtr) >> 8);
-            break;
-          }
-          case PixelFormat::Uint32: {
-            rowBufferRaw[iWrite] = uint8_t(*((uint32_t*) dataPtr) >> 24);
-            break;
-          }
-          case PixelFormat::Uint64: {
-            rowBufferRaw[iWrite] = uint8_t(*((uint64_t*) dataPtr) >> 56);
-            break;
-          }
-          case PixelFormat::Float16: {
-            uint16_t half = *((uint16_t*) dataPtr);
-            float v = half_to_float(half);
-            rowBufferRaw[iWrite] = uint8_t(min(v * 256, 255));
-            break;
-          }
-          case PixelFormat::Float32: {
-            float v = *((float*) dataPtr);
-            rowBufferRaw[iWrite] = uint8_t(min(v * 256, 255));
-            break;
-          }
-          case PixelFormat::Float64: {
-            double v = *((double*) dataPtr);
-            rowBufferRaw[iWrite] = uint8_t(min(v * 256, 255));
-            break;
+    const TransformOps ops = transform_ops(params.transform);
+    const uint32_t mcuWidth = dinfo->max_h_samp_factor * DCTSIZE;
+    const uint32_t mcuHeight = dinfo->max_v_samp_factor * DCTSIZE;
+
+    if (params.cropX >= dinfo->image_width || params.cropY >= dinfo->image_height) {
+      throw Error("Crop region is outside the image");
+    }
+    const uint32_t cropX = params.cropX - params.cropX % mcuWidth;
+    const uint32_t cropY = params.cropY - params.cropY % mcuHeight;
+    uint32_t width = (params.cropWidth ? params.cropWidth : dinfo->image_width - params.cropX) + params.cropX - cropX;
+    uint32_t height = (params.cropHeight ? params.cropHeight : dinfo->image_height - params.cropY)
+                      + params.cropY - cropY;
+    if (cropX + width > dinfo->image_width || cropY + height > dinfo->image_height) {
+      throw Error("Crop region is outside the image");
+    }
+
+    // Trim the partial iMCU off mirrored axes
+    if (ops.mirrorX) width -= width % mcuWidth;
+    if (ops.mirrorY) height -= height % mcuHeight;
+    if (width == 0 || height == 0) throw Error("Image is too small to be transformed without a partial iMCU");
+
+    /*
+     * Set up compression with the source's quantization tables and sampling
+     */
+    jpeg_copy_critical_parameters(dinfo, cinfo);
+    reset_huffman_tables(cinfo);
+
+    cinfo->image_width = ops.transpose ? height : width;
+    cinfo->image_height = ops.transpose ? width : height;
+    if (ops.transpose) {
+      for (int iComp = 0; iComp < cinfo->num_components; iComp++) {
+        std::swap(cinfo->comp_info[iComp].h_samp_factor, cinfo->comp_info[iComp].v_samp_factor);
+      }
+      for (JQUANT_TBL* table: cinfo->quant_tbl_ptrs) {
+        if (!table) continue;
+        for (uint32_t v = 0; v < DCTSIZE; v++) {
+          for (uint32_t u = v + 1; u < DCTSIZE; u++) {
+            std::swap(table->quantval[v * DCTSIZE + u], table->quantval[u * DCTSIZE + v]);
           }
         }
       }
     }
 
-    jpeg_write_scanlines(&m_cinfo, &rowBufferRaw, 1);
-  }
+    cinfo->optimize_coding = params.optimizeHuffman;
+    if (params.progressive) jpeg_simple_progression(cinfo);
+
+    /*
+     * The source arrays are written as they are when the whole image is kept,
+     * otherwise blocks are copied into new arrays
+     */
+    const bool identity = params.transform == Transform::None
+                          && width == dinfo->image_width && height == dinfo->image_height;
+    jvirt_barray_ptr* dstArrays = srcArrays;
+    std::array<uint32_t, MAX_COMPONENTS> srcWidths{}, srcHeights{};
+
+    if (!identity) {
+      dstArrays = static_cast<jvirt_barray_ptr*>((*cinfo->mem->alloc_small)(
+        reinterpret_cast<j_common_ptr>(cinfo), JPOOL_IMAGE, sizeof(jvirt_barray_ptr) * cinfo->num_components
+      ));
 
-  jpeg_finish_compress(&m_cinfo);
+      for (int iComp = 0; iComp < dinfo->num_components; iComp++) {
+        const jpeg_component_info& comp = dinfo->comp_info[iComp];
+        srcWidths[iComp] = (width + mcuWidth - 1) / mcuWidth * comp.h_samp_factor;
+        srcHeights[iComp] = (height + mcuHeight - 1) / mcuHeight * comp.v_samp_factor;
 
-  // Write to file
-  // TODO use a writer object
-  auto file = std::ofstream(params.outPath, std::ios_base::out | std::ios_base::binary);
-  file.write((char*) buf, std::streamsize(size));
+        const jpeg_component_info& outComp = cinfo->comp_info[iComp];
+        dstArrays[iComp] = (*cinfo->mem->request_virt_barray)(
+          reinterpret_cast<j_common_ptr>(cinfo), JPOOL_IMAGE, FALSE,
+          ops.transpose ? srcHeights[iComp] : srcWidths[iComp],
+          ops.transpose ? srcWidths[iComp] : srcHeights[iComp],
+          outComp.v_samp_factor
+        );
+      }
+    }
+
+    // Writes the headers and realizes the output arrays
+    jpeg_write_coefficients(cinfo, dstArrays);
+    if (params.copyMarkers) copy_markers(dinfo, cinfo);
+
+    if (!identity) {
+      for (int iComp = 0; iComp < cinfo->num_components; iComp++) {
+        const jpeg_component_info& comp = cinfo->comp_info[iComp];
+        transform_component(
+          dinfo, srcArrays[iComp], cinfo, dstArrays[iComp], comp,
+          cropX / mcuWidth * dinfo->comp_info[iComp].h_samp_factor,
+          cropY / mcuHeight * dinfo->comp_info[iComp].v_samp_factor,
+          srcWidths[iComp], srcHeights[iComp], ops
+        );
+      }
+    }
 
-  // Release resources
-  free(buf);
-  file.close();
+    jpeg_finish_compress(cinfo);
+
+    const ImageInfo info = {
+      .width = cinfo->image_width,
+      .height = cinfo->image_height,
+      .jpegWidth = dinfo->image_width,
+      .jpegHeight = dinfo->image_height,
+      .jpegComponents = uint32_t(dinfo->num_components),
+      .progressive = bool(dinfo->progressive_mode),
+    };
+    jpeg_finish_decompress(dinfo);
+    return info;
+  } catch (...) {
+    jpeg_abort_compress(cinfo);
+    jpeg_abort_decompress(dinfo);
+    throw;
+  }
 }
 
 }
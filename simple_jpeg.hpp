@@ -1,9 +1,26 @@
 #ifndef SIMPLE_JPEG_SIMPLE_JPEG_HPP
 #define SIMPLE_JPEG_SIMPLE_JPEG_HPP
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
 #include <filesystem>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include <jpeglib.h>
 
@@ -14,6 +31,12 @@ namespace jpeg {
 enum class ColorMode {
   RGB,
   Grayscale,
+  // Planar YCbCr input, with chroma at full resolution
+  YCbCr444,
+  // Planar YCbCr input, with chroma at half horizontal resolution
+  YCbCr422,
+  // Planar YCbCr input, with chroma at half horizontal and vertical resolution
+  YCbCr420,
 };
 
 enum class ColorSpace {
@@ -36,6 +59,229 @@ enum class PixelFormat {
   Float64,
 };
 
+/*
+ * Resolution of the chroma channels relative to luma, for RGB output
+ */
+enum class ChromaSubsampling {
+  // Full resolution
+  Chroma444,
+  // Half horizontal resolution
+  Chroma422,
+  // Half horizontal and vertical resolution
+  Chroma420,
+};
+
+/*
+ * DCT implementation used by libjpeg
+ */
+enum class DctMethod {
+  // Accurate integer DCT (libjpeg's JDCT_ISLOW)
+  Integer,
+  // Faster, less accurate integer DCT (JDCT_IFAST)
+  IntegerFast,
+  // Floating point DCT (JDCT_FLOAT)
+  Float,
+};
+
+class HuffmanTables;
+
+/*
+ * Compression settings, trading encode speed against output size
+ * The defaults match libjpeg's own defaults.
+ */
+struct Compression {
+  // Quality, from 1 to 100
+  int quality = 75;
+
+  /*
+   * Largest size of the output, in bytes (0 = no limit)
+   * The image is converted and transformed to DCT coefficients once. A search
+   * over qualities up to quality then only quantizes and entropy codes those
+   * coefficients, usually a handful of times, keeping the highest quality that
+   * fits; if none does, quality 1 is written. The result is deterministic, but
+   * can differ slightly from encoding at the chosen quality directly, since
+   * coefficients are rounded twice. The coefficients of the whole image are
+   * held in memory until it's finished.
+   */
+  size_t targetBytes = 0;
+
+  ChromaSubsampling subsampling = ChromaSubsampling::Chroma420;
+  DctMethod dctMethod = DctMethod::Integer;
+
+  /*
+   * Compute optimal Huffman tables for each image
+   * Shrinks the output by a few percent, at the cost of an extra pass over the
+   * image data.
+   */
+  bool optimizeHuffman = false;
+
+  /*
+   * Write a progressive JPEG
+   * Usually smaller than baseline and displays incrementally, but much slower
+   * to encode. Implies optimized Huffman tables.
+   */
+  bool progressive = false;
+
+  // Restart interval, in MCUs (0 = no restart markers)
+  uint32_t restartInterval = 0;
+
+  /*
+   * Huffman tables shared between images (optional, see HuffmanTables)
+   * Used in place of the standard tables when neither optimizeHuffman nor
+   * progressive is set.
+   */
+  const HuffmanTables* huffmanTables = nullptr;
+
+  bool operator==(const Compression& other) const = default;
+
+  /*
+   * Presets
+   * These only pick speed and size settings, quality is left at the default.
+   */
+  static constexpr Compression fastest() {
+    return {.dctMethod = DctMethod::IntegerFast};
+  }
+
+  static constexpr Compression balanced() {
+    return {};
+  }
+
+  static constexpr Compression smallest() {
+    return {.optimizeHuffman = true, .progressive = true};
+  }
+};
+
+/*
+ * A single plane of planar input
+ */
+struct Plane {
+  // First row of the plane
+  const void* data = nullptr;
+  // Row stride, in bytes (-1 = auto: the width of the plane)
+  int32_t rowStride = -1;
+};
+
+/*
+ * Order tiles are stored in
+ */
+enum class TileOrder {
+  // Left to right, then top to bottom
+  RowMajor,
+  // Top to bottom, then left to right
+  ColumnMajor,
+};
+
+/*
+ * Layout of tiled input
+ * The image is stored as a grid of fixed-size tiles, each holding its pixels
+ * row by row. Strides and offsets in EncodeParams apply within a tile, except
+ * that inRowStride is the row stride inside a tile (auto: inPixelStride *
+ * tile width). inPixelOffset and inRowOffset locate the image in the grid, so
+ * they may cross tile boundaries.
+ */
+struct Tiling {
+  // Size of a tile, in pixels (0 = input isn't tiled)
+  uint32_t width = 0;
+  uint32_t height = 0;
+  // Distance between the starts of consecutive tiles, in bytes (-1 = auto: inRowStride * tile height)
+  int32_t stride = -1;
+  TileOrder order = TileOrder::RowMajor;
+  /*
+   * Number of tiles in a row of the grid (RowMajor) or a column (ColumnMajor)
+   * (0 = auto: enough to cover the image, offsets included)
+   */
+  uint32_t gridStride = 0;
+};
+
+/*
+ * Tone curve for Uint16 input
+ * Maps every 16-bit input value to an 8-bit output through a lookup table, in
+ * place of the default truncation to the top 8 bits. Build a curve once and
+ * share it between encodes, it's only read while encoding.
+ */
+class ToneCurve {
+public:
+  /*
+   * Build a curve from a function mapping input in [0, 1] to output in [0, 1]
+   * Outputs are clamped and rounded to the nearest 8-bit value.
+   */
+  explicit ToneCurve(const std::function<float(float)>& curve);
+
+  /*
+   * Power curve, output = input ^ (1 / gamma)
+   */
+  static ToneCurve gamma(float gamma);
+
+  [[nodiscard]] const uint8_t* table() const noexcept { return m_table.data(); }
+
+private:
+  std::vector<uint8_t> m_table;
+};
+
+/*
+ * Phases of an encode, as reported by EncodeStats and trace events
+ */
+enum class EncodePhase {
+  // Configuring libjpeg and writing the headers
+  Setup,
+  // Writing the ICC profile
+  Markers,
+  // Converting input rows to 8bpc
+  Conversion,
+  // libjpeg color conversion, DCT and entropy coding
+  Compression,
+  // Handing encoded data to the writer
+  Output,
+};
+
+/*
+ * Statistics for a single encode, filled in when requested through
+ * EncodeParams::stats
+ * Phase times are only measured when stats are requested or a trace callback
+ * is set. Writes happen inside the other phases, mostly compression; their time
+ * is counted in outputTime only.
+ */
+struct EncodeStats {
+  std::chrono::nanoseconds setupTime{};
+  std::chrono::nanoseconds markerTime{};
+  std::chrono::nanoseconds conversionTime{};
+  std::chrono::nanoseconds compressionTime{};
+  std::chrono::nanoseconds outputTime{};
+  // Wall time from the start of the encode until it finished
+  std::chrono::nanoseconds totalTime{};
+
+  // Bytes of input pixels read, including unused channels
+  uint64_t bytesIn = 0;
+  // Bytes of encoded data handed to the writer
+  uint64_t bytesOut = 0;
+  uint32_t scanlines = 0;
+
+  // Memory used for the image: libjpeg's working state, conversion buffers and the output buffer
+  size_t peakBufferBytes = 0;
+  // Number of heap allocations the encoder made for this image, 0 once it's warmed up
+  uint32_t allocations = 0;
+
+  // Quality the image was written at, the one found for Compression::targetBytes if set
+  int quality = 0;
+};
+
+/*
+ * A timed span of an encode, passed to the encoder's trace callback
+ * Output events happen during compression, so they nest inside Compression
+ * (and Setup or Markers) events.
+ */
+struct TraceEvent {
+  EncodePhase phase;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::nanoseconds duration;
+  // Rows converted or compressed, for Conversion and Compression events
+  uint32_t rows = 0;
+  // Bytes written, for Output events
+  size_t bytes = 0;
+};
+
+using TraceCallback = std::function<void(const TraceEvent& event)>;
+
 /*
  * Parameters for encoding a JPEG image
  */
@@ -47,8 +293,9 @@ struct EncodeParams {
 
   /*
    * Input color mode
-   * Currently only RGB and grayscale are supported. JPEG does not support
+   * RGB and grayscale input is interleaved. JPEG does not support
    * transparency: for RGBA buffers, use RGB mode and inChannels = 4.
+   * YCbCr input is planar, see planes.
    */
   ColorMode colorMode = ColorMode::RGB;
 
@@ -64,6 +311,22 @@ struct EncodeParams {
    */
   PixelFormat pixelFormat = PixelFormat::Uint8;
 
+  /*
+   * Tone curve for Uint16 input (optional)
+   * Must stay alive until the encode is finished.
+   */
+  const ToneCurve* toneCurve = nullptr;
+
+  /*
+   * Linear-light input (optional), with the primaries of the given color space
+   * Floating point input only. Pixels are converted to the gamut of colorSpace
+   * and encoded with the sRGB transfer curve (which Display P3 shares) as rows
+   * are converted, so the frame doesn't need a separate pass. Colors outside
+   * the output gamut are clipped. Grayscale input only has the transfer curve
+   * applied. For linear Uint16 input, use a tone curve.
+   */
+  std::optional<ColorSpace> linearInput;
+
   /*
    * Number of channels in input data (-1 = auto)
    * Auto: three channels are assumed for RGB and one for grayscale.
@@ -103,11 +366,154 @@ struct EncodeParams {
    */
   uint32_t inRowOffset = 0;
 
+  /*
+   * Planes for planar input
+   * When the first plane is set, RGB and grayscale input is read from one
+   * plane per component (R, G, B or gray) of packed samples in the given pixel
+   * format, instead of from the data pointer passed to encode. inChannels,
+   * inChannelOffset and inPixelStride don't apply.
+   *
+   * YCbCr input is always planar, in Y, Cb, Cr order. The planes are passed
+   * to libjpeg as-is, skipping color conversion and downsampling. Only Uint8
+   * is supported. Chroma planes are subsampled as given by the color mode,
+   * with their size rounded up, and the color mode's subsampling is used for
+   * the output. inPixelOffset and inRowOffset are in luma pixels, and must be
+   * multiples of the subsampling factors.
+   */
+  std::array<Plane, 3> planes = {};
+
+  /*
+   * Tile layout for tiled input
+   * Rows are converted a tile at a time, reading only the tiles that cover the
+   * strip being compressed, so a tiled buffer doesn't need converting to
+   * scanlines first. Interleaved RGB and grayscale input only.
+   */
+  Tiling tiling = {};
+
+  /*
+   * Compression settings
+   */
+  Compression compression = {};
+
   /*
    * Output file path
+   * Only used by the encode overload that doesn't take a writer.
    */
   fs::path outPath = fs::current_path() / "out.jpeg";
 
+  /*
+   * Statistics output (optional)
+   * If set, the stats are reset when the encode starts and filled in as it
+   * runs. Not filled in when EncoderPool::encodeParallel splits the image into
+   * bands.
+   */
+  EncodeStats* stats = nullptr;
+
+  [[nodiscard]] constexpr size_t channelStride() const {
+    switch (pixelFormat) {
+      case PixelFormat::Uint8: return 1;
+      case PixelFormat::Uint16:
+      case PixelFormat::Float16: return 2;
+      case PixelFormat::Uint32:
+      case PixelFormat::Float32: return 4;
+      case PixelFormat::Uint64:
+      case PixelFormat::Float64: return 8;
+    }
+  }
+};
+
+/*
+ * Huffman tables shared by a batch of encodes
+ * Optimized once for a sample image and passed in Compression::huffmanTables,
+ * they give similar images most of the size reduction of optimizeHuffman
+ * without its second pass, and keep the setup of every image cheap. Every
+ * symbol has a code, so the tables can encode any image. They're only read
+ * while encoding, so they can be shared between threads.
+ */
+class HuffmanTables {
+public:
+  /*
+   * Build tables optimized for a sample image, described by params as for an
+   * encode (optimizeHuffman and progressive are ignored)
+   */
+  static HuffmanTables fromSample(void* data, const EncodeParams& params);
+
+private:
+  friend class Encoder;
+
+  // Luma DC, chroma DC, luma AC, chroma AC
+  std::array<JHUFF_TBL, 4> m_tables{};
+};
+
+/*
+ * Parameters for decoding a JPEG image
+ * The output layout is described the same way as the input of EncodeParams.
+ */
+struct DecodeParams {
+  /*
+   * Output color mode
+   * Only RGB and grayscale are supported.
+   */
+  ColorMode colorMode = ColorMode::RGB;
+
+  /*
+   * Pixel format of the output data
+   * Integer formats are scaled to their full range, floating point formats to
+   * [0, 1].
+   */
+  PixelFormat pixelFormat = PixelFormat::Uint8;
+
+  /*
+   * Scaling factor, scaleNum / scaleDenom
+   * libjpeg scales while computing the inverse DCT, in steps of 1/8 (rounded
+   * up). Scaling by 1/2, 1/4 or 1/8 skips most of the decoding work, which
+   * makes it the fastest way to produce thumbnails.
+   */
+  uint32_t scaleNum = 1;
+  uint32_t scaleDenom = 1;
+
+  DctMethod dctMethod = DctMethod::Integer;
+
+  /*
+   * Smooth chroma upsampling
+   * Disabling it is faster, but blockier.
+   */
+  bool fancyUpsampling = true;
+
+  /*
+   * Number of channels in output data (-1 = auto)
+   * Auto: three channels for RGB and one for grayscale. Channels that aren't
+   * written to are left untouched.
+   */
+  int32_t outChannels = -1;
+
+  // Channel offset when writing pixel data
+  uint32_t outChannelOffset = 0;
+
+  /*
+   * Pixel stride, in bytes (-1 = auto)
+   * Auto: outChannels * <format size>
+   */
+  int32_t outPixelStride = -1;
+
+  // Pixel (horizontal) offset of the image in the output buffer
+  uint32_t outPixelOffset = 0;
+
+  /*
+   * Row stride, in bytes (-1 = auto)
+   * Auto: outPixelStride * width
+   */
+  int32_t outRowStride = -1;
+
+  // Row (vertical) offset of the image in the output buffer
+  uint32_t outRowOffset = 0;
+
+  /*
+   * ICC profile output (optional)
+   * If set, filled with the embedded ICC profile, or cleared if there is none.
+   */
+  std::vector<uint8_t>* iccProfile = nullptr;
+
   [[nodiscard]] constexpr size_t channelStride() const {
     switch (pixelFormat) {
       case PixelFormat::Uint8: return 1;
@@ -118,11 +524,246 @@ struct EncodeParams {
       case PixelFormat::Uint64:
       case PixelFormat::Float64: return 8;
     }
+    return 1;
   }
 };
 
+/*
+ * Lossless transform, applied to the DCT coefficients of an image
+ */
+enum class Transform {
+  None,
+  FlipHorizontal,
+  FlipVertical,
+  // Mirror across the top-left to bottom-right diagonal
+  Transpose,
+  // Mirror across the top-right to bottom-left diagonal
+  Transverse,
+  // Clockwise rotations
+  Rotate90,
+  Rotate180,
+  Rotate270,
+};
+
+struct TransformParams {
+  Transform transform = Transform::None;
+
+  /*
+   * Crop region, in pixels of the source image (width and height 0 = to the
+   * right and bottom edges)
+   * Cropping works on whole iMCUs (8 or 16 pixels, depending on the chroma
+   * subsampling), so the top-left corner is moved up and left to the nearest
+   * iMCU boundary, growing the region to match. The crop is applied before the
+   * transform.
+   */
+  uint32_t cropX = 0;
+  uint32_t cropY = 0;
+  uint32_t cropWidth = 0;
+  uint32_t cropHeight = 0;
+
+  /*
+   * Compute optimal Huffman tables for the output, which usually makes it a few
+   * percent smaller than the source, at the cost of a second pass over the
+   * coefficients
+   * Transforming with no other changes re-optimizes an existing file.
+   */
+  bool optimizeHuffman = false;
+  bool progressive = false;
+
+  /*
+   * Copy APPn and COM markers from the source, which hold the ICC profile and
+   * EXIF data among others
+   * The EXIF orientation tag is copied as is.
+   */
+  bool copyMarkers = true;
+};
+
+/*
+ * Information about a decoded image
+ */
+struct ImageInfo {
+  // Size of the decoded image, after scaling
+  uint32_t width;
+  uint32_t height;
+
+  // Size of the image as stored
+  uint32_t jpegWidth;
+  uint32_t jpegHeight;
+
+  // Number of components stored in the JPEG (1 for grayscale, 3 for YCbCr)
+  uint32_t jpegComponents;
+  bool progressive;
+};
+
+/*
+ * Error raised when encoding or decoding fails, either from libjpeg itself or
+ * from invalid parameters. Writers and file input report I/O failures as
+ * std::system_error.
+ */
+class Error : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+/*
+ * Output sink for encoded JPEG data
+ * The encoder hands data to the writer in chunks while compression runs, so
+ * output can be streamed without holding the whole image in memory.
+ * Implementations should throw if a write fails.
+ */
+class Writer {
+public:
+  virtual ~Writer() = default;
+
+  /*
+   * Write a chunk of encoded data
+   */
+  virtual void write(const uint8_t* data, size_t size) = 0;
+
+  /*
+   * Called once all data for an image has been written
+   */
+  virtual void flush() {}
+};
+
+/*
+ * Writes to a file descriptor. The descriptor is not closed by the writer.
+ */
+class FileDescriptorWriter : public Writer {
+public:
+  explicit FileDescriptorWriter(int fd) noexcept;
+
+  void write(const uint8_t* data, size_t size) override;
+
+private:
+  int m_fd;
+};
+
+/*
+ * Writes to a C stdio file. A file opened from a path is owned and closed by
+ * the writer, a FILE* passed in is left open.
+ */
+class FileWriter : public Writer {
+public:
+  explicit FileWriter(FILE* file) noexcept;
+  explicit FileWriter(const fs::path& path);
+  ~FileWriter() override;
+
+  FileWriter(const FileWriter& writer) = delete;
+  FileWriter& operator=(const FileWriter& writer) = delete;
+
+  void write(const uint8_t* data, size_t size) override;
+  void flush() override;
+
+private:
+  FILE* m_file;
+  bool m_owned;
+};
+
+/*
+ * Writes to a growable memory buffer. Clearing the writer keeps the allocated
+ * capacity, so it can be reused across images without reallocating.
+ */
+class MemoryWriter : public Writer {
+public:
+  void write(const uint8_t* data, size_t size) override;
+
+  [[nodiscard]] const uint8_t* data() const noexcept { return m_buffer.data(); }
+  [[nodiscard]] size_t size() const noexcept { return m_buffer.size(); }
+  [[nodiscard]] const std::vector<uint8_t>& buffer() const noexcept { return m_buffer; }
+
+  void clear() noexcept { m_buffer.clear(); }
+
+private:
+  std::vector<uint8_t> m_buffer;
+};
+
+/*
+ * Forwards encoded data to a user callback
+ */
+class CallbackWriter : public Writer {
+public:
+  using Callback = std::function<void(const uint8_t* data, size_t size)>;
+
+  explicit CallbackWriter(Callback callback) noexcept;
+
+  void write(const uint8_t* data, size_t size) override;
+
+private:
+  Callback m_callback;
+};
+
+/*
+ * Hands data to another writer on a background thread, so slow storage doesn't
+ * stall compression
+ * Writes are copied into one of a fixed number of reusable buffers, which are
+ * queued for the I/O thread as they fill up; write only blocks when every
+ * buffer is waiting to be written. The underlying writer must outlive this one.
+ * Errors from the underlying writer are raised from the next write or flush,
+ * failing the encode, and from the future returned by sync. After an error,
+ * nothing more is written.
+ */
+class AsyncWriter : public Writer {
+public:
+  explicit AsyncWriter(Writer& writer, size_t bufferCount = 4, size_t bufferSize = 1024 * 1024);
+  // Waits for everything written to be handed to the underlying writer
+  ~AsyncWriter() override;
+
+  AsyncWriter(const AsyncWriter& writer) = delete;
+  AsyncWriter& operator=(const AsyncWriter& writer) = delete;
+
+  void write(const uint8_t* data, size_t size) override;
+
+  /*
+   * Queue the data written so far, to be written and flushed in the background
+   * Doesn't wait for the underlying writer.
+   */
+  void flush() override;
+
+  /*
+   * Flush, returning a future that's ready once everything written so far has
+   * been written and flushed, or holds the error that stopped it
+   */
+  std::future<void> sync();
+
+private:
+  struct Block {
+    size_t buffer;
+    size_t size;
+    bool flush;
+    std::optional<std::promise<void>> done;
+  };
+
+  void submit(bool flush, std::optional<std::promise<void>> done);
+  void run();
+
+  Writer& m_writer;
+  std::vector<std::vector<uint8_t>> m_buffers;
+  // Buffer being filled, owned by the writing thread
+  size_t m_current = 0;
+  size_t m_used = 0;
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_released;
+  std::deque<Block> m_queue;
+  std::vector<size_t> m_free;
+  std::exception_ptr m_error;
+  bool m_stopping = false;
+  std::thread m_thread;
+};
+
+/*
+ * JPEG encoder
+ * Each encoder owns a libjpeg compression object, which is reused across
+ * images. An encoder can only be used from one thread at a time; use an
+ * EncoderPool to encode in parallel. A moved-from encoder can only be assigned
+ * to or destroyed.
+ */
 class Encoder {
 public:
+  class Session;
+
   Encoder() noexcept;
   ~Encoder();
 
@@ -132,11 +773,394 @@ public:
   Encoder& operator=(const Encoder& enc) = delete;
   Encoder& operator=(Encoder&& enc) noexcept;
 
+  /*
+   * Encode an image to the file at params.outPath
+   */
   void encode(void* data, const EncodeParams& params);
 
+  /*
+   * Encode an image, streaming the output to a writer as compression runs
+   */
+  void encode(void* data, const EncodeParams& params, Writer& writer);
+
+  /*
+   * Encode an image to memory
+   * The output vector is cleared and filled with the encoded data. Its capacity
+   * is kept, so reusing the same vector across calls avoids reallocating once
+   * it's grown to fit the largest image.
+   */
+  void encode(void* data, const EncodeParams& params, std::vector<uint8_t>& out);
+
+  /*
+   * Encode raw pixel data read from a file, laid out as described by params
+   * (planar and tiled input aren't supported), to outPath, a writer or memory
+   * The file is memory-mapped and read sequentially, releasing pages once
+   * they're encoded, so huge files only need a small resident set. Where it
+   * can't be mapped, it's streamed through a buffer instead.
+   */
+  void encode(const fs::path& input, const EncodeParams& params);
+  void encode(const fs::path& input, const EncodeParams& params, Writer& writer);
+  void encode(const fs::path& input, const EncodeParams& params, std::vector<uint8_t>& out);
+
+  /*
+   * Start an incremental encode
+   * Rows are compressed as they're written to the session, so they can be fed
+   * in as they're produced and only a single strip of converted rows is held in
+   * memory. The encoder can't be used for anything else until the session is
+   * finished or destroyed.
+   */
+  [[nodiscard]] Session begin(const EncodeParams& params, Writer& writer);
+
+  /*
+   * Set a callback receiving a trace event for every timed span of every
+   * encode (an empty callback disables tracing)
+   * Events are reported per strip of rows and per write, from the thread
+   * running the encode.
+   */
+  void setTraceCallback(TraceCallback callback);
+
+  /*
+   * Cap the working memory of the encoder, in bytes (0 = no limit)
+   * libjpeg's per-image state and the conversion buffers come from an arena
+   * owned by the encoder. It's kept between images, so once it has grown to
+   * fit the largest image, encodes don't allocate. Images needing more than the
+   * limit fail with jpeg::Error. Memory above a lowered limit is released when
+   * the next image starts.
+   */
+  void setMemoryLimit(size_t bytes);
+
+  /*
+   * Most working memory any image has used so far, in bytes
+   */
+  [[nodiscard]] size_t memoryHighWater() const noexcept;
+
+private:
+  friend class EncoderPool;
+  friend class HuffmanTables;
+  friend class Transformer;
+
+  struct Destination;
+
+  /*
+   * Overrides used by EncoderPool when encoding an image as separate bands
+   */
+  struct BandOptions {
+    // Restart interval written in the header, in MCUs
+    uint32_t restartInterval = 0;
+    // Only the first band's header is kept, so the others skip the ICC profile
+    bool embedProfile = true;
+  };
+
+  struct Pipeline;
+  struct Arena;
+
+  void encode(void* data, const EncodeParams& params, Writer& writer, const BandOptions& band);
+
+  Session begin(const EncodeParams& params, Writer& writer, const BandOptions& band);
+  void start(const EncodeParams& params, const BandOptions& band);
+  void startPlanes(const EncodeParams& params);
+  void startTiles(const EncodeParams& params);
+  void writeRows(const void* data, uint32_t nRows);
+  void writeRaw();
+  void convertTiles(const uint8_t* data, uint32_t firstRow, uint32_t nRows);
+  void finish();
+  void finishToTarget();
+  void compressTrial(int quality, MemoryWriter& out);
+  void abort();
+
+  bool timed() const noexcept;
+  std::chrono::steady_clock::time_point record(
+    EncodePhase phase, std::chrono::steady_clock::time_point start, uint32_t rows = 0, size_t bytes = 0
+  );
+
+  std::unique_ptr<jpeg_compress_struct> m_cinfo;
+  std::unique_ptr<jpeg_error_mgr> m_jerr;
+  std::unique_ptr<Destination> m_dest;
+  std::unique_ptr<Arena> m_arena;
+  std::unique_ptr<Pipeline> m_pipeline;
+  TraceCallback m_trace;
+};
+
+/*
+ * Incremental encode session, created by Encoder::begin
+ * Dropping a session before calling finish discards the image.
+ */
+class Encoder::Session {
+public:
+  Session(const Session& session) = delete;
+  Session(Session&& session) noexcept;
+
+  Session& operator=(const Session& session) = delete;
+  Session& operator=(Session&& session) noexcept;
+
+  ~Session();
+
+  /*
+   * Compress the next rows of the image
+   * data points to the first row to write, laid out as described by the params
+   * the session was started with. Pixel and channel offsets and strides apply
+   * as usual, inRowOffset is ignored.
+   * For planar input, data is not used: rows are read from the planes, which
+   * must hold the rows written so far. Planar YCbCr rows are compressed once a
+   * whole MCU row is available.
+   * For tiled input, data points to the start of the tile grid, which must
+   * hold the rows written so far. Rows continue from the last row written,
+   * starting at inRowOffset.
+   */
+  void writeRows(const void* data, uint32_t nRows);
+
+  /*
+   * Finish the image once all rows have been written, and flush the writer
+   */
+  void finish();
+
+  [[nodiscard]] uint32_t rowsWritten() const noexcept;
+
 private:
-  jpeg_compress_struct m_cinfo{};
-  jpeg_error_mgr m_jerr{};
+  friend class Encoder;
+
+  explicit Session(Encoder* encoder) noexcept;
+
+  Encoder* m_encoder;
+};
+
+/*
+ * A single job for an EncoderPool
+ */
+struct EncodeJob {
+  // Input buffer, described by params
+  void* data;
+
+  EncodeParams params;
+
+  /*
+   * Output writer
+   * If null, the image is written to params.outPath. A writer must not be
+   * shared by jobs that may run at the same time.
+   */
+  Writer* writer = nullptr;
+};
+
+/*
+ * Layout of a Deep Zoom tile pyramid, built by EncoderPool::encodePyramid
+ */
+struct PyramidParams {
+  // Size of a tile in pixels, not counting overlap
+  uint32_t tileSize = 254;
+  // Pixels each tile repeats from its neighbours, on every side that has one
+  uint32_t overlap = 1;
+
+  /*
+   * Embed the ICC profile of the color space in every tile
+   * The profile is repeated in each tile, which adds up for small tiles.
+   * Viewers generally treat untagged tiles as sRGB.
+   */
+  bool embedProfile = true;
+};
+
+/*
+ * Position of a tile in a pyramid
+ */
+struct PyramidTile {
+  // Level, from 0 (a single pixel) up to full resolution
+  uint32_t level;
+  uint32_t column;
+  uint32_t row;
+  // Size of the tile in pixels, including overlap
+  uint32_t width;
+  uint32_t height;
+};
+
+/*
+ * Pool of worker threads, each owning an Encoder
+ * Jobs are spread across the workers' queues, and idle workers steal queued
+ * jobs from busy ones.
+ */
+class EncoderPool {
+public:
+  /*
+   * Called from a worker thread when a job finishes, with the index of the job
+   * in the batch and the exception it failed with (or null on success)
+   */
+  using CompletionCallback = std::function<void(size_t index, std::exception_ptr error)>;
+
+  /*
+   * Create a pool with the given number of worker threads (0 = one per core)
+   */
+  explicit EncoderPool(size_t threads = 0);
+  ~EncoderPool();
+
+  EncoderPool(const EncoderPool& pool) = delete;
+  EncoderPool& operator=(const EncoderPool& pool) = delete;
+
+  [[nodiscard]] size_t threadCount() const noexcept { return m_workers.size(); }
+
+  /*
+   * Encode a batch of jobs, blocking until all of them have finished
+   * Failures are reported per job through onComplete. Without a callback, the
+   * first failure is rethrown once the whole batch is done.
+   */
+  void encodeBatch(std::span<const EncodeJob> jobs, const CompletionCallback& onComplete = {});
+
+  /*
+   * Queue a single job, returning a future that completes when it's done
+   * The job's input buffer and writer must stay alive until then.
+   */
+  std::future<void> submit(const EncodeJob& job);
+
+  /*
+   * Encode a single image using all workers
+   * The image is split into horizontal bands aligned to MCU rows, addressed
+   * with inRowOffset and height. The bands are compressed in parallel and
+   * joined into one baseline JPEG, with a restart interval covering exactly
+   * one band so the bands are separated by RSTn markers.
+   * Falls back to a single band when the image is too small to split, too
+   * wide for a band to fit in the maximum restart interval, or when optimized
+   * Huffman tables or progressive mode are requested, since those need the
+   * statistics of the whole image.
+   */
+  void encodeParallel(void* data, const EncodeParams& params, Writer& writer);
+
+  /*
+   * Encode a single image using all workers, to the file at params.outPath
+   */
+  void encodeParallel(void* data, const EncodeParams& params);
+
+  /*
+   * Called from a worker thread with each encoded tile of a pyramid
+   * The data is only valid during the call.
+   */
+  using TileCallback = std::function<void(const PyramidTile& tile, std::span<const uint8_t> data)>;
+
+  /*
+   * Build a Deep Zoom tile pyramid of an image, passing each tile to onTile
+   * The input is interleaved RGB or grayscale, laid out as described by params
+   * (planar and tiled input aren't supported). Tiles are encoded with the
+   * compression settings and color space of params.
+   * The pyramid is built in one pass from the top of the image down: full
+   * resolution rows are converted a tile row at a time, and each level is
+   * halved into the next with a box filter as its rows become available. Only
+   * a few tile rows of each level are held in memory. Tiles and downsampling
+   * are spread across all workers, and each worker reuses its encoder and
+   * output buffer for every tile.
+   */
+  void encodePyramid(void* data, const EncodeParams& params, const PyramidParams& pyramid, const TileCallback& onTile);
+
+  /*
+   * Build a Deep Zoom tile pyramid, writing the descriptor to params.outPath
+   * (for example image.dzi) and the tiles next to it, as
+   * image_files/<level>/<column>_<row>.jpeg
+   */
+  void encodePyramid(void* data, const EncodeParams& params, const PyramidParams& pyramid);
+
+  /*
+   * Set the trace callback of every worker's encoder
+   * The callback is called from the worker threads, and must not be changed
+   * while jobs are running.
+   */
+  void setTraceCallback(const TraceCallback& callback);
+
+private:
+  using Task = std::function<void(Encoder& encoder)>;
+  struct Worker;
+
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::vector<Encoder> m_encoders;
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  // Tasks in all queues, changed under a queue's lock along with the queue itself
+  std::atomic<size_t> m_pending = 0;
+  size_t m_nextQueue = 0;
+  bool m_stopping = false;
+
+  void push(size_t queue, Task task);
+  bool pop(size_t worker, Task& task);
+  void run(size_t worker);
+  void parallelFor(size_t count, const std::function<void(size_t index, Encoder& encoder)>& body);
+};
+
+/*
+ * JPEG decoder
+ * Each decoder owns a libjpeg decompression object, which is reused across
+ * images. Like an Encoder, a decoder can only be used from one thread at a
+ * time, and a moved-from decoder can only be assigned to or destroyed.
+ */
+class Decoder {
+public:
+  Decoder() noexcept;
+  ~Decoder();
+
+  Decoder(const Decoder& dec) = delete;
+  Decoder(Decoder&& dec) noexcept;
+
+  Decoder& operator=(const Decoder& dec) = delete;
+  Decoder& operator=(Decoder&& dec) noexcept;
+
+  /*
+   * Read the header of an image, returning its size as it would be decoded
+   * with params
+   */
+  ImageInfo readInfo(std::span<const uint8_t> jpeg, const DecodeParams& params = {});
+  ImageInfo readInfo(const fs::path& path, const DecodeParams& params = {});
+
+  /*
+   * Decode an image to a buffer laid out as described by params
+   * The buffer must be large enough for the scaled image, see readInfo.
+   */
+  ImageInfo decode(std::span<const uint8_t> jpeg, void* out, const DecodeParams& params = {});
+  ImageInfo decode(const fs::path& path, void* out, const DecodeParams& params = {});
+
+  /*
+   * Decode an image to a vector, which is resized to fit
+   * Like Encoder's vector overload, the capacity is kept between calls.
+   */
+  ImageInfo decode(std::span<const uint8_t> jpeg, std::vector<uint8_t>& out, const DecodeParams& params = {});
+  ImageInfo decode(const fs::path& path, std::vector<uint8_t>& out, const DecodeParams& params = {});
+
+private:
+  friend class Transformer;
+
+  struct Source;
+
+  ImageInfo start(const DecodeParams& params);
+  ImageInfo decode(void* out, std::vector<uint8_t>* outVector, const DecodeParams& params);
+
+  std::unique_ptr<jpeg_decompress_struct> m_dinfo;
+  std::unique_ptr<jpeg_error_mgr> m_jerr;
+  std::unique_ptr<Source> m_source;
+  std::vector<uint8_t> m_stripBuffer;
+  std::vector<JSAMPROW> m_stripRows;
+};
+
+/*
+ * Rewrites JPEGs without decoding them, working on the quantized DCT
+ * coefficients: crops, flips and rotations are exact, and much faster than a
+ * decode and encode round trip.
+ * Flipping an axis moves the partial iMCU at its end to the start, where it
+ * can't be represented, so that partial iMCU is trimmed off.
+ */
+class Transformer {
+public:
+  /*
+   * Transform an image, writing the result to writer and returning the size of
+   * the output (width, height) and source (jpeg*)
+   */
+  ImageInfo transform(std::span<const uint8_t> jpeg, const TransformParams& params, Writer& writer);
+  ImageInfo transform(const fs::path& path, const TransformParams& params, Writer& writer);
+
+  /*
+   * Transform an image into a vector, replacing its contents
+   */
+  ImageInfo transform(std::span<const uint8_t> jpeg, const TransformParams& params, std::vector<uint8_t>& out);
+  ImageInfo transform(const fs::path& path, const TransformParams& params, std::vector<uint8_t>& out);
+
+private:
+  ImageInfo transform(const TransformParams& params, Writer& writer);
+
+  // Only their libjpeg objects, source and destination are used
+  Decoder m_decoder;
+  Encoder m_encoder;
 };
 
 }